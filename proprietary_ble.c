@@ -40,7 +40,7 @@ Zachary Bernal 2/10/2020
 for [REDACTED] interview
 
 This code runs on a linux system with:
-	gcc -g -Wall -lm -o proprietary_ble proprietary_ble.c
+	gcc -g -Wall -pthread -o proprietary_ble proprietary_ble.c -lm
 	chmod +x proprietary_ble
 	./proprietary_ble
 
@@ -64,19 +64,36 @@ I decided to use a static memory pool since all the device objects are the same
 
 I really didn't need to do this much, but it was fun and I'm procrastinating talking to more recruiters. You can disable my nonsense by defining USE_FIXED_POOL to 0.
 
-None of this is thread-safe, but I don't feel like having *that* much fun with this. Mutexes could be used to wrap the queue and the memory pool if needed.
+A tracker itself isn't thread-safe: one thread (or one lock) has to own on_discovery() and everything else that changes it. Other threads and processes only read, through the snapshot table and what's built on it (shared memory export, query server). The sharded tracker gives each shard its own lock and worker thread.
 
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <inttypes.h>
 #include <math.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define USE_FIXED_POOL 1
 
@@ -88,16 +105,67 @@ typedef struct {
   uint8_t rssi;
 } pair_adv_data_t;
 
+// The members of pair_adv_data_t every tracked device keeps in place
+typedef struct device_adv {
+	uint32_t device_id;
+	uint8_t rssi;
+} device_adv_t;
+
+// The members that never change and are often identical across devices, see payload_store_t
+typedef struct device_payload {
+	uint8_t device_name[16];
+	uint8_t device_data[64];
+} device_payload_t;
+
+/*
+ * Only what every tracker needs is kept here. Devices link to each other by
+ * pool slot + 1 (see device_ref()), and the links of optional features live
+ * in per-slot arrays that only exist while the feature is on. The rest of
+ * the advertisement follows in the pool block, as the tracker's profile has it.
+ */
 typedef struct device {
 	// Data returned from advertising function
-	pair_adv_data_t adv;
-	unsigned long long discovery_time;
+	device_adv_t adv;
+	// Eviction policy bookkeeping, for whichever policy the tracker uses
+	union {
+		uint32_t hits;
+		uint8_t referenced;
+		uint32_t log_pos;
+	};
 	
 	// Queue implemented with doubly linked list
-	struct device *next;
-	struct device *prev;
+	uint32_t next;
+	uint32_t prev;
+	
+	// device_id index bucket chain
+	uint32_t id_next;
+	
+	unsigned long long discovery_time;
 } device_t;
 
+// Pool block of a tracker_init() tracker: a copy of everything
+typedef struct device_block_full {
+	device_t dev;
+	device_payload_t payload;
+	uint32_t rf_address;
+} device_block_full_t;
+
+// Pool block of a tracker_init_interned() tracker: name and data are in the payload store
+typedef struct device_block_interned {
+	device_t dev;
+	const device_payload_t *payload;
+	uint32_t rf_address;
+} device_block_interned_t;
+
+// Pool block of a tracker_init_metadata() tracker: what the reports show and nothing else
+typedef struct device_block_metadata {
+	device_t dev;
+	uint8_t device_name[16];
+} device_block_metadata_t;
+
+// Default number of devices to remember, straight from the problem description
+#define TRACKER_CAPACITY 32
+
 /*
  * ==========================
  * Mock systime_ms_get()
@@ -108,7 +176,8 @@ unsigned long long systime_ms_get() {
     struct timespec spec;
     clock_gettime(CLOCK_REALTIME, &spec);
 	// Whole seconds and milliseconds are stored separately. Add both fields to obtain a timestamp in ms.
-	return (unsigned long long)spec.tv_sec * 1000 + round(spec.tv_nsec / 1000000.0);
+	// Rounds to the nearest ms in integer math, same as round() without going through a double.
+	return (unsigned long long)spec.tv_sec * 1000 + (spec.tv_nsec + 500000) / 1000000;
 }
 
 /*
@@ -129,9 +198,12 @@ typedef struct fixedpool {
 	struct blockheader *nextfree;
 	size_t blocksize;
 	uint32_t blockcount;
+	// pool_index() divides by the block stride with a shift and a multiply, see pool_init()
+	uint32_t stride_shift;
+	uint32_t stride_inverse;
 } fixedpool_t;
 
-uint8_t device_pool[ sizeof(fixedpool_t) + (32 * (sizeof(blockheader_t) + sizeof(device_t))) ];
+#define POOL_BYTES(blocksize, blockcount) ( sizeof(fixedpool_t) + ((blockcount) * (sizeof(blockheader_t) + (blocksize))) )
 
 #define GET_BLOCK_FROM_MEM(mem) ( (blockheader_t *)((void *)mem - sizeof(blockheader_t)) )
 #define GET_MEM_FROM_BLOCK(block) ( (void *)block + sizeof(blockheader_t) )
@@ -139,9 +211,21 @@ uint8_t device_pool[ sizeof(fixedpool_t) + (32 * (sizeof(blockheader_t) + sizeof
 void pool_init(uint8_t *pool, size_t blocksize, uint32_t blockcount) {
 	int i;
 	fixedpool_t *header = (fixedpool_t *)pool;
+	size_t stride = sizeof(blockheader_t) + blocksize;
+	uint32_t odd;
 	header->blocksize = blocksize;
 	header->blockcount = blockcount;
 	
+	// Block offsets are exact multiples of the stride, so dividing one by it is
+	// shifting out the stride's factors of two and multiplying by the inverse of
+	// the odd rest mod 2^32. Newton's iteration doubles the correct bits each step.
+	header->stride_shift = __builtin_ctzll(stride);
+	odd = stride >> header->stride_shift;
+	header->stride_inverse = odd;
+	for (i = 0; i < 4; i++) {
+		header->stride_inverse *= 2 - odd * header->stride_inverse;
+	}
+	
 	blockheader_t *prev = NULL;
 	blockheader_t *cur = NULL;
 	// Walk backwards to build the stack, so that it allocates in memory order.
@@ -188,6 +272,28 @@ void pool_free(uint8_t *pool, void *ptr) {
 	//printf("Freeing mem: %p block: %p\n", ptr, block);
 }
 
+// Blocks are laid out back to back, so every block has a stable slot index
+uint32_t pool_index(uint8_t *pool, void *ptr) {
+	fixedpool_t *header = (fixedpool_t *)pool;
+	uint8_t *block = (uint8_t *)GET_BLOCK_FROM_MEM(ptr);
+	return (uint32_t)((block - &pool[sizeof(fixedpool_t)]) >> header->stride_shift) * header->stride_inverse;
+}
+
+void * pool_mem(uint8_t *pool, uint32_t index) {
+	fixedpool_t *header = (fixedpool_t *)pool;
+	return GET_MEM_FROM_BLOCK(&pool[ sizeof(fixedpool_t) + (index * (sizeof(blockheader_t) + header->blocksize))]);
+}
+
+// The pool's memory moved by delta bytes (say, mapped at a new address): fix up the free list
+void pool_rebase(uint8_t *pool, ptrdiff_t delta) {
+	fixedpool_t *header = (fixedpool_t *)pool;
+	blockheader_t *block;
+	if (header->nextfree != NULL) header->nextfree = (blockheader_t *)((uint8_t *)header->nextfree + delta);
+	for (block = header->nextfree; block != NULL; block = block->nextfree) {
+		if (block->nextfree != NULL) block->nextfree = (blockheader_t *)((uint8_t *)block->nextfree + delta);
+	}
+}
+
 void pool_print(uint8_t *pool) {
 	int i;
 	fixedpool_t *header = (fixedpool_t *)pool;
@@ -210,20 +316,80 @@ void pool_print(uint8_t *pool) {
 
 #else //USE_FIXED_POOL
 
-uint8_t device_pool[4];
+// Every block is malloc'd on its own. The pool only hands out slot indices,
+// which are stored in a word in front of the block.
+typedef struct mallocpool {
+	size_t blocksize;
+	uint32_t blockcount;
+	uint32_t freecount;
+} mallocpool_t;
+
+#define POOL_BYTES(blocksize, blockcount) ( sizeof(mallocpool_t) + ((blockcount) * (sizeof(uint32_t) + sizeof(void *))) )
+#define SLOT_HEADER_SIZE sizeof(uint64_t)
+
+// Stack of free slot indices, followed by the block pointer for each slot
+uint32_t * pool_freeslots(uint8_t *pool) {
+	return (uint32_t *)&pool[sizeof(mallocpool_t)];
+}
+
+void ** pool_blocks(uint8_t *pool) {
+	mallocpool_t *header = (mallocpool_t *)pool;
+	return (void **)&pool[sizeof(mallocpool_t) + header->blockcount * sizeof(uint32_t)];
+}
 
 void pool_init(uint8_t *pool, size_t blocksize, uint32_t blockcount) {
+	uint32_t i;
+	mallocpool_t *header = (mallocpool_t *)pool;
+	header->blocksize = blocksize;
+	header->blockcount = blockcount;
+	header->freecount = blockcount;
+	// Reverse order, so that slot 0 gets allocated first
+	for (i = 0; i < blockcount; i++) {
+		pool_freeslots(pool)[i] = blockcount - 1 - i;
+		pool_blocks(pool)[i] = NULL;
+	}
 }
 
 void pool_destroy(uint8_t *pool) {
+	memset(pool, 0, sizeof(mallocpool_t));
 }
 
 void * pool_alloc(uint8_t *pool, size_t size) {
-	return malloc(size);
+	mallocpool_t *header = (mallocpool_t *)pool;
+	uint32_t slot;
+	uint8_t *mem;
+	if (header->freecount == 0) {
+		return NULL;
+	}
+	mem = malloc(SLOT_HEADER_SIZE + size);
+	if (mem == NULL) {
+		return NULL;
+	}
+	slot = pool_freeslots(pool)[--header->freecount];
+	*(uint32_t *)mem = slot;
+	pool_blocks(pool)[slot] = mem + SLOT_HEADER_SIZE;
+	return mem + SLOT_HEADER_SIZE;
 }
 
 void pool_free(uint8_t *pool, void *ptr) {
-	free(ptr);
+	mallocpool_t *header = (mallocpool_t *)pool;
+	uint32_t slot;
+	if (ptr == NULL) {
+		printf("WARNING: null free!\n");
+		return;
+	}
+	slot = *(uint32_t *)((uint8_t *)ptr - SLOT_HEADER_SIZE);
+	pool_blocks(pool)[slot] = NULL;
+	pool_freeslots(pool)[header->freecount++] = slot;
+	free((uint8_t *)ptr - SLOT_HEADER_SIZE);
+}
+
+uint32_t pool_index(uint8_t *pool, void *ptr) {
+	return *(uint32_t *)((uint8_t *)ptr - SLOT_HEADER_SIZE);
+}
+
+void * pool_mem(uint8_t *pool, uint32_t index) {
+	return pool_blocks(pool)[index];
 }
 
 void pool_print(uint8_t *pool) {
@@ -234,289 +400,6569 @@ void pool_print(uint8_t *pool) {
 
 /*
  * ==========================
- * Device queue
+ * Payload store
  * ==========================
  */
-int device_count = 0;
-device_t *head = NULL;
-device_t *tail = NULL;
 
 /*
- * Find a duplicate device in the queue.
- * Returns: -1 for no duplicate, or pointer to duplicate
+ * device_name and device_data never change for a device, and devices of the
+ * same model and firmware tend to advertise identical ones. A payload store
+ * keeps one reference counted copy of each distinct payload, found by a hash
+ * of its content, for trackers set up with tracker_init_interned(). Those
+ * only hash a payload when a device gets admitted. Trackers on the same
+ * thread can share a store; it isn't thread-safe.
  */
-device_t * find_duplicate(pair_adv_data_t *data) {
-	device_t *cur = head;
-	for (cur = head; cur != NULL; cur = cur->next) {
-		// device_id is enough to uniquely identify a device
-		if (cur->adv.device_id == data->device_id) {
-			break;
-		}
+typedef struct payload_entry {
+	// First, so a payload pointer is an entry pointer too
+	device_payload_t payload;
+	uint64_t hash;
+	uint32_t refs;
+	// Bucket chain, or the free list when refs is 0: entry index + 1, 0 ends it
+	uint32_t next;
+} payload_entry_t;
+
+typedef struct payload_store {
+	payload_entry_t *entries;
+	uint32_t *buckets;
+	uint32_t capacity;
+	uint32_t free_head;
+	// Distinct payloads held, and devices pointing at them
+	uint32_t count;
+	uint32_t refs;
+} payload_store_t;
+
+// One bucket per entry
+#define PAYLOAD_STORE_BYTES(entries) ( (entries) * (sizeof(payload_entry_t) + sizeof(uint32_t)) )
+
+// mem must hold PAYLOAD_STORE_BYTES(entries) bytes, 8 byte aligned
+void payload_store_init(payload_store_t *store, uint8_t *mem, uint32_t entries) {
+	uint32_t i;
+	memset(store, 0, sizeof(payload_store_t));
+	store->entries = (payload_entry_t *)mem;
+	store->buckets = (uint32_t *)&store->entries[entries];
+	store->capacity = entries;
+	memset(store->buckets, 0, entries * sizeof(uint32_t));
+	for (i = 0; i < entries; i++) {
+		store->entries[i].refs = 0;
+		store->entries[i].next = i + 2 <= entries ? i + 2 : 0;
 	}
-	return cur;
+	store->free_head = entries > 0 ? 1 : 0;
 }
 
-void queue_remove(device_t *node) {
-	if (node != NULL) {
-		if (head == node) head = node->next;
-		if (tail == node) tail = node->prev;
-		if (node->prev != NULL) node->prev->next = node->next;
-		if (node->next != NULL) node->next->prev = node->prev;
-		node->prev = NULL;
-		node->next = NULL;
-		--device_count;
+uint64_t payload_hash(const uint8_t *name, const uint8_t *data) {
+	uint64_t words[10];
+	uint64_t hash = 0;
+	int i;
+	memcpy(words, name, 16);
+	memcpy(&words[2], data, 64);
+	for (i = 0; i < 10; i++) {
+		hash = (hash ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
 	}
+	return hash;
 }
 
-void queue_push(device_t *node) {
-	if (node != NULL) {
-		node->prev = NULL;
-		node->next = head;
-		if (head != NULL) head->prev = node;
-		head = node;
-		if (tail == NULL) tail = node;
-		++device_count;
-	}
+// Multiply-shift the hash onto the buckets, no power of two needed
+uint32_t * payload_bucket(payload_store_t *store, uint64_t hash) {
+	return &store->buckets[((hash >> 32) * store->capacity) >> 32];
 }
 
-device_t * queue_pop(void) {
-	device_t *node = tail;
-	if (node != NULL) {
-		tail = node->prev;
-		if (tail != NULL) tail->next = NULL;
-		if (head == node) head = NULL;
-		--device_count;
+/*
+ * Take a reference to the stored copy of this name and data, adding it if
+ * it's new. O(1) expected.
+ * Returns: the payload, or NULL if it's new and the store is full
+ */
+const device_payload_t * payload_intern(payload_store_t *store, const uint8_t *name, const uint8_t *data) {
+	uint64_t hash = payload_hash(name, data);
+	uint32_t *bucket = payload_bucket(store, hash);
+	payload_entry_t *entry;
+	uint32_t index;
+	
+	for (index = *bucket; index != 0; index = entry->next) {
+		entry = &store->entries[index - 1];
+		if (entry->hash == hash && memcmp(entry->payload.device_name, name, 16) == 0 &&
+				memcmp(entry->payload.device_data, data, 64) == 0) {
+			entry->refs++;
+			store->refs++;
+			return &entry->payload;
+		}
 	}
-	return node;
+	if (store->free_head == 0) return NULL;
+	index = store->free_head;
+	entry = &store->entries[index - 1];
+	store->free_head = entry->next;
+	memcpy(entry->payload.device_name, name, 16);
+	memcpy(entry->payload.device_data, data, 64);
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->next = *bucket;
+	*bucket = index;
+	store->count++;
+	store->refs++;
+	return &entry->payload;
 }
 
-void queue_clear(void) {
-	while (head != NULL) {
-		pool_free(device_pool, queue_pop());
-	}
+// Drop a reference from payload_intern(), freeing the entry with the last one
+void payload_release(payload_store_t *store, const device_payload_t *payload) {
+	payload_entry_t *entry = (payload_entry_t *)payload;
+	uint32_t index = entry - store->entries + 1;
+	uint32_t *link;
+	
+	store->refs--;
+	if (--entry->refs > 0) return;
+	for (link = payload_bucket(store, entry->hash); *link != index; link = &store->entries[*link - 1].next);
+	*link = entry->next;
+	entry->next = store->free_head;
+	store->free_head = index;
+	store->count--;
 }
 
 /*
  * ==========================
- * Device discovery and printing
+ * Ingestion pre-filter
  * ==========================
  */
-void on_discovery(pair_adv_data_t *data) {
-	unsigned long long timestamp = systime_ms_get();
-	
-	device_t *dupe = find_duplicate(data); // O(n)
 
-	if (dupe != NULL){
-		queue_remove(dupe); 
-		queue_push(dupe); 
-		dupe->adv.rssi = data->rssi;
-		dupe->discovery_time = timestamp;
-	}
-	else
-	{
-		device_t *new;
-		
-		// This protects against an edge case 
-		// where we somehow get more than 32 devices
-		// in the list. Shouldn't happen unless there's a bug.
-		while (device_count > 32) {
-			printf("WARNING: large device_count %d\n", device_count);
-			pool_free(device_pool, queue_pop());
-		}
-		if (device_count == 32) {
-			// reuse oldest slot instead of reallocating
-			device_t *old = queue_pop();
-			new = old;
-		}
-		else {
-			new = pool_alloc(device_pool, sizeof(device_t));
-		}
-		memcpy(new, data, sizeof(pair_adv_data_t));
-		new->discovery_time = timestamp;
-		queue_push(new);
+/*
+ * Advertisements match a filter when their device_id is on its list or their
+ * device_name starts with its name prefix. An allow filter drops everything
+ * that doesn't match, a deny filter drops everything that does.
+ *
+ * Short id lists are kept exactly as a sorted array. Longer ones only go into
+ * a Bloom filter (10 bits per id, ~1% false positives): an allowlist then lets
+ * the odd foreign device through, a denylist drops the odd device it shouldn't.
+ */
+#define FILTER_ALLOW 0
+#define FILTER_DENY 1
+#define FILTER_EXACT_MAX 64
+#define FILTER_BLOOM_BITS_PER_ID 10
+#define FILTER_BLOOM_HASHES 7
+
+// Storage filter_init() needs for count ids
+#define FILTER_STORAGE_BYTES(count) ( (count) <= FILTER_EXACT_MAX ? \
+		(count) * sizeof(uint32_t) : \
+		(((count) * FILTER_BLOOM_BITS_PER_ID + 63) / 64) * sizeof(uint64_t) )
+
+typedef struct adv_filter {
+	int mode;
+	// Exact list, sorted
+	uint32_t *ids;
+	uint32_t id_count;
+	// Bloom filter, when the list is too long to keep exactly
+	uint64_t *bloom;
+	uint32_t bloom_bits;
+	uint8_t name_prefix[16];
+	int name_prefix_len;
+	uint32_t passed_count;
+	uint32_t dropped_count;
+} adv_filter_t;
+
+int filter_compare_ids(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// splitmix64 finalizer; the two halves seed the Bloom filter's double hashing
+uint64_t filter_hash(uint32_t device_id) {
+	uint64_t x = device_id + 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+void filter_bloom_add(adv_filter_t *f, uint32_t device_id) {
+	uint64_t h = filter_hash(device_id);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	uint32_t bit;
+	int i;
+	for (i = 0; i < FILTER_BLOOM_HASHES; i++) {
+		bit = ((uint64_t)(h1 + i * h2) * f->bloom_bits) >> 32;
+		f->bloom[bit / 64] |= 1ULL << (bit % 64);
 	}
-	
 }
 
-void print_queue_by_time(void) {
-	device_t *cur;
-	printf("Devices ordered by time (queue ordering):\n");
-	for (cur = head; cur != NULL; cur = cur->next) {
-		printf("time: %llu\tdev: %d\trssi: %d\n", 
-				cur->discovery_time, 
-				cur->adv.device_id,
-				cur->adv.rssi);
+int filter_bloom_test(adv_filter_t *f, uint32_t device_id) {
+	uint64_t h = filter_hash(device_id);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	uint32_t bit;
+	int i;
+	for (i = 0; i < FILTER_BLOOM_HASHES; i++) {
+		bit = ((uint64_t)(h1 + i * h2) * f->bloom_bits) >> 32;
+		if (!(f->bloom[bit / 64] & (1ULL << (bit % 64)))) return 0;
 	}
+	return 1;
 }
 
-void print_queue_by_rssi(void) {
-	// Sort by RSSI using insertion sort, which is good enough for small # of elements O(n^2)
-	device_t *sorted[32] = {0};
-	int next_i = 0;
-	int j = 0;
-	device_t *to_insert;
-	
-	for (to_insert = head; to_insert != NULL; to_insert = to_insert->next) {
-		if (next_i >= 32) {
-			printf("WARNING: large device_count %d\n", device_count);
-			break;
-		}
-		sorted[next_i] = to_insert;
-		j = next_i;
-		while(j > 0 && sorted[j]->adv.rssi > sorted[j-1]->adv.rssi) {
-			device_t *temp = sorted[j];
-			sorted[j] = sorted[j-1];
-			sorted[j-1] = temp;
-			j--;
+/*
+ * Build a filter over count device ids.
+ * storage must hold FILTER_STORAGE_BYTES(count) bytes, 8 byte aligned.
+ */
+void filter_init(adv_filter_t *f, int mode, const uint32_t *ids, uint32_t count, void *storage) {
+	uint32_t i;
+	memset(f, 0, sizeof(*f));
+	f->mode = mode;
+	if (count <= FILTER_EXACT_MAX) {
+		f->ids = storage;
+		f->id_count = count;
+		memcpy(f->ids, ids, count * sizeof(uint32_t));
+		qsort(f->ids, count, sizeof(uint32_t), filter_compare_ids);
+	}
+	else {
+		f->bloom = storage;
+		f->bloom_bits = ((count * FILTER_BLOOM_BITS_PER_ID + 63) / 64) * 64;
+		memset(f->bloom, 0, f->bloom_bits / 8);
+		for (i = 0; i < count; i++) {
+			filter_bloom_add(f, ids[i]);
 		}
-		next_i++;
 	}
-	printf("Devices ordered by RSSI (descending):\n");
-	for (j = 0; j < 32; j++) {
-		printf("time: %llu\tdev: %d\trssi: %d\n", 
-				sorted[j]->discovery_time, 
-				sorted[j]->adv.device_id,
-				sorted[j]->adv.rssi);
+}
+
+void filter_set_name_prefix(adv_filter_t *f, const char *prefix) {
+	f->name_prefix_len = strnlen(prefix, sizeof(f->name_prefix));
+	memcpy(f->name_prefix, prefix, f->name_prefix_len);
+}
+
+int filter_matches(adv_filter_t *f, pair_adv_data_t *data) {
+	uint32_t lo = 0, hi = f->id_count, mid;
+	if (f->name_prefix_len > 0 && memcmp(data->device_name, f->name_prefix, f->name_prefix_len) == 0) {
+		return 1;
+	}
+	if (f->bloom != NULL) {
+		return filter_bloom_test(f, data->device_id);
+	}
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (f->ids[mid] < data->device_id) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < f->id_count && f->ids[lo] == data->device_id;
+}
+
+// Returns: 1 if the advertisement should be tracked, 0 if it was dropped
+int filter_accepts(adv_filter_t *f, pair_adv_data_t *data) {
+	if (filter_matches(f, data) == (f->mode == FILTER_ALLOW)) {
+		f->passed_count++;
+		return 1;
 	}
+	f->dropped_count++;
+	return 0;
 }
 
 /*
  * ==========================
- * Tests
+ * Device queue
  * ==========================
  */
+typedef struct tracker tracker_t;
 
-void test_time(void) {
-	unsigned long long timestamp;
-	timestamp = systime_ms_get();
-	printf("======== test_time ========\n");
-	printf("Timestamp: %llu\n", timestamp);
-}
+/*
+ * Eviction policy, called by the tracker whenever a device enters, gets
+ * re-observed in, or leaves the queue. The policy owns the queue ordering:
+ * choose_victim() only picks a device, the tracker then calls on_remove().
+ */
+typedef struct eviction_policy {
+	const char *name;
+	void (*on_insert)(tracker_t *t, device_t *node);
+	void (*on_hit)(tracker_t *t, device_t *node);
+	device_t * (*choose_victim)(tracker_t *t);
+	void (*on_remove)(tracker_t *t, device_t *node);
+	// Set if the queue is always in order of discovery time
+	int time_ordered;
+} eviction_policy_t;
 
+// Observation log entry, see tracker_use_log()
+typedef struct log_record {
+	unsigned long long discovery_time;
+	uint32_t slot;
+} log_record_t;
 
-#if USE_FIXED_POOL
-#define TEST_POOL_SIZE 4
-void test_pool(void) {
-	int i;
-	device_t *pointers[TEST_POOL_SIZE];
+#define LOG_TOMBSTONE UINT32_MAX
+
+/*
+ * Per-slot links of the optional lists (timer wheel, RSSI index). The first
+ * device on a list has SLOT_LIST_HEAD | its bucket as prev, 0 means not listed.
+ */
+typedef struct slot_link {
+	uint32_t next;
+	uint32_t prev;
+} slot_link_t;
+
+#define SLOT_LIST_HEAD 0x80000000u
+
+// Per-slot change tracking: generations it was admitted and last changed at, and
+// the list of devices ordered by last change. See tracker_track_changes()
+typedef struct change_link {
+	unsigned long long insert_gen;
+	unsigned long long change_gen;
+	uint32_t next;
+	uint32_t prev;
+} change_link_t;
+
+// How advertisements folded into an entry by rate limiting update its RSSI
+#define RSSI_FOLD_LATEST 0
+#define RSSI_FOLD_MAX 1
+
+// Devices that left the tracker, kept around for delta reports
+typedef struct eviction_record {
+	unsigned long long generation;
+	uint32_t device_id;
+} eviction_record_t;
+
+#define EVICTION_LOG_SIZE 256
+
+// Hierarchical timer wheel: 4 levels of 64 slots cover 2^24 ticks
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct tracker {
+	uint8_t *pool;
+	// Scratch space for sorted reports, one entry per device
+	const device_t **sorted;
+	// Hash index on device_id, one bucket per device
+	uint32_t *id_buckets;
+	int capacity;
+	int device_count;
+	// Queue implemented with doubly linked list.
+	// With LRU this is in order of discovery time.
+	device_t *head;
+	device_t *tail;
+	const eviction_policy_t *policy;
 	
-	printf("======== test_pool ========\n");
+	// Queue implemented with an append-only observation log instead.
+	// log_head and log_tail count records forever and get masked on access.
+	log_record_t *log;
+	uint32_t log_mask;
+	uint32_t log_head;
+	uint32_t log_tail;
 	
-	pool_init(device_pool, sizeof(device_t), TEST_POOL_SIZE);
-	pool_print(device_pool);
+	// Time based expiry, see tracker_set_max_age()
+	unsigned long long max_age_ms;
+	unsigned long long wheel_resolution_ms;
+	unsigned long long wheel_tick;
+	uint32_t wheel_count;
+	uint32_t wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+	slot_link_t *timer_links;
+	uint32_t expired_count;
 	
-	for (i = 0; i < TEST_POOL_SIZE; i++) {
-		pointers[i] = pool_alloc(device_pool, sizeof(device_t));
-	}
-	pool_print(device_pool);
-	for (i = 0; i < TEST_POOL_SIZE; i++) {
-		pool_free(device_pool, pointers[i]);
-	}
-	pool_print(device_pool);
-	pool_destroy(device_pool);
+	// Per-device rate limiting, see tracker_set_rate_limit()
+	unsigned long long min_update_ms;
+	int rssi_fold;
+	uint32_t coalesced_count;
+	
+	// Optional pre-filter, checked before any queue work
+	adv_filter_t *filter;
+	
+	// Where device payloads live: NULL for right behind each device in its
+	// pool block, else interned in this store, see tracker_init_interned()
+	payload_store_t *store;
+	size_t block_size;
+	// Set when the block only has room for device_name, see tracker_init_metadata()
+	int metadata_only;
+	
+	// Optional hash index on rf_address, one bucket per device, see tracker_use_rf_index()
+	uint32_t *rf_buckets;
+	uint32_t *rf_next;
+	
+	// Optional sorted index on device_name, see tracker_use_name_index()
+	struct name_key *name_keys;
+	int name_count;
+	
+	// Optional per-slot columns for filtered reports, see tracker_use_report_columns()
+	uint64_t *col_time;
+	uint64_t *col_live;
+	uint8_t *col_rssi;
+	
+	// Optional incremental RSSI ordering, see tracker_use_rssi_index()
+	int rssi_indexed;
+	uint64_t rssi_bitmap[4];
+	uint32_t rssi_bucket[256];
+	slot_link_t *rssi_links;
+	
+	// Optional change tracking for delta reports, see tracker_track_changes()
+	int changes_tracked;
+	unsigned long long generation;
+	change_link_t *change_links;
+	uint32_t changed_head;
+	uint32_t changed_tail;
+	eviction_record_t evictions[EVICTION_LOG_SIZE];
+	unsigned long long eviction_count;
+	// Reports from before this generation may have missed evictions
+	unsigned long long evictions_lost_gen;
+	
+	// Optional lock-free copy of the device table for other threads
+	struct snapshot *snapshot;
+	
+	// Optional capture of every advertisement handed to the tracker
+	struct trace_recorder *recorder;
+	
+	// Set when the tracker lives in a file mapping, see tracker_persist_open()
+	struct persist_header *persist;
+};
+
+// Devices link to each other by pool slot + 1, so 0 is none and links stay valid wherever the pool is mapped
+uint32_t device_ref(tracker_t *t, const device_t *node) {
+	return node != NULL ? pool_index(t->pool, (void *)node) + 1 : 0;
 }
-#else
-void test_pool(void) {
+
+device_t * device_at(tracker_t *t, uint32_t ref) {
+	return ref != 0 ? pool_mem(t->pool, ref - 1) : NULL;
 }
-#endif
 
-// Test that the queue can fill up and pop old devices off the end
-void test_queue_fill(void) {
-	int i;
-	pair_adv_data_t cur = {0};
-	uint8_t rssi = 1;
-	printf("======== test_queue_fill ========\n");
-	for (i = 1; i <= 64; i++) {
-		cur.rssi = rssi;
-		cur.device_id = i;
-		// unimportant info for this test run
-		/*
-		sprintf((char *)cur.device_name, "proprietary_%02d", i);
-		sprintf((char *)cur.device_data, "data_%02d", i);
-		cur.rf_address = i;
-		*/
-		
-		on_discovery(&cur);
-		// wait a bit to get a new timestamp
-		usleep(5 *1000);
-		// scramble RSSI 
-		rssi += 21;
-	}
-	print_queue_by_time();
-	queue_clear();
+// Not on a tracker_init_metadata() tracker, which only keeps device_name: see device_data()
+const device_payload_t * device_payload(const tracker_t *t, const device_t *dev) {
+	if (t->store != NULL) return ((const device_block_interned_t *)dev)->payload;
+	return &((const device_block_full_t *)dev)->payload;
 }
 
-// Reinstert the same 5 devices over and over again
-void test_duplicates(void) {
-	int i, j;
-	pair_adv_data_t cur = {0};
-	uint8_t rssi = 1;
-	printf("======== test_duplicates ========\n");
-	for (j = 1; j <= 3; j++) {
-		printf("Round %d\n", j);
-		for (i = 1; i <= 5; i++) {
-			cur.rssi = rssi;
-			cur.device_id = i;			
-			on_discovery(&cur);
-			// wait a bit to get a new timestamp
-			usleep(5 *1000);
-			
-			// scramble RSSI 
-			rssi += 21;
+// Every tracker profile keeps device_name
+const uint8_t * device_name(const tracker_t *t, const device_t *dev) {
+	if (t->metadata_only) return ((const device_block_metadata_t *)dev)->device_name;
+	return device_payload(t, dev)->device_name;
+}
+
+// A device's device_data, or NULL if t is metadata-only and never kept it
+const uint8_t * device_data(const tracker_t *t, const device_t *dev) {
+	return t->metadata_only ? NULL : device_payload(t, dev)->device_data;
+}
+
+// A device's rf_address, or 0 if t is metadata-only and never kept it
+uint32_t device_rf_address(const tracker_t *t, const device_t *dev) {
+	if (t->metadata_only) return 0;
+	if (t->store != NULL) return ((const device_block_interned_t *)dev)->rf_address;
+	return ((const device_block_full_t *)dev)->rf_address;
+}
+
+/*
+ * Walk the log backwards from pos to the newest record that hasn't been tombstoned.
+ * Returns: NULL when there are no live records older than pos
+ */
+device_t * log_live_before(tracker_t *t, uint32_t pos) {
+	while (pos != t->log_tail) {
+		pos--;
+		if (t->log[pos & t->log_mask].slot != LOG_TOMBSTONE) {
+			return pool_mem(t->pool, t->log[pos & t->log_mask].slot);
 		}
-		print_queue_by_time();
 	}
-	queue_clear();
+	return NULL;
 }
 
-// Make sure recurring devices don't drown out all others
-void test_duplicates_and_uniques(void) {
-	int i, j;
-	int udc = 6; // unique device counter
-	pair_adv_data_t cur = {0};
-	uint8_t rssi = 1;
-	printf("======== test_duplicates_and_uniques ========\n");
-	
-	// unique devices
-	for (i = 1; i <= 32; i++) {
-		cur.rssi = rssi;
-		cur.device_id = udc++;			
-		on_discovery(&cur);
-		// wait a bit to get a new timestamp
-		usleep(5 *1000);
-		
-		// scramble RSSI 
-		rssi += 21;
+// Walk the queue from most recent to least recent, whichever way it is stored
+device_t * queue_first(tracker_t *t) {
+	if (t->log != NULL) return log_live_before(t, t->log_head);
+	return t->head;
+}
+
+device_t * queue_next(tracker_t *t, device_t *cur) {
+	if (t->log != NULL) return log_live_before(t, cur->log_pos);
+	return device_at(t, cur->next);
+}
+
+// Fibonacci hash, scaled to the bucket count without a division
+uint32_t id_bucket(tracker_t *t, uint32_t device_id) {
+	return ((uint64_t)(device_id * 0x9e3779b1u) * (uint32_t)t->capacity) >> 32;
+}
+
+void id_index_add(tracker_t *t, device_t *node) {
+	uint32_t *bucket = &t->id_buckets[id_bucket(t, node->adv.device_id)];
+	node->id_next = *bucket;
+	*bucket = device_ref(t, node);
+}
+
+void id_index_remove(tracker_t *t, device_t *node) {
+	uint32_t *link = &t->id_buckets[id_bucket(t, node->adv.device_id)];
+	uint32_t ref = device_ref(t, node);
+	while (*link != 0) {
+		if (*link == ref) {
+			*link = node->id_next;
+			node->id_next = 0;
+			return;
+		}
+		link = &device_at(t, *link)->id_next;
 	}
-	// recurring devices; they should not push out old devices
-	for (j = 1; j <= 7; j++) {
-		for (i = 1; i <= 5; i++) {
-			cur.rssi = rssi;
-			cur.device_id = i;			
-			on_discovery(&cur);
-			// wait a bit to get a new timestamp
-			usleep(5 *1000);
-			
-			// scramble RSSI 
-			rssi += 21;
+}
+
+// Same scheme for rf_address, which only the radio stack's connection and error reports carry
+void rf_index_add(tracker_t *t, device_t *node) {
+	uint32_t *bucket = &t->rf_buckets[id_bucket(t, device_rf_address(t, node))];
+	uint32_t ref = device_ref(t, node);
+	t->rf_next[ref - 1] = *bucket;
+	*bucket = ref;
+}
+
+void rf_index_remove(tracker_t *t, device_t *node) {
+	uint32_t *link = &t->rf_buckets[id_bucket(t, device_rf_address(t, node))];
+	uint32_t ref = device_ref(t, node);
+	while (*link != 0) {
+		if (*link == ref) {
+			*link = t->rf_next[ref - 1];
+			t->rf_next[ref - 1] = 0;
+			return;
 		}
+		link = &t->rf_next[*link - 1];
 	}
-	print_queue_by_time();
-	print_queue_by_rssi();
-	queue_clear();
 }
 
-int main(int argc, char**argv) {
-	printf("Proprietary BLE pairing test\n");
-	test_pool();
-	pool_init(device_pool, sizeof(device_t), 32);
-	test_time();
+/*
+ * device_name index: a sorted array with one key per device. A key is the
+ * 16 name bytes as two big-endian words, so comparing the words compares the
+ * names byte by byte, and a prefix is a masked compare of the same two words.
+ */
+typedef struct name_key {
+	uint64_t hi;
+	uint64_t lo;
+	device_t *device;
+} name_key_t;
+
+void name_key_load(const uint8_t *name, uint64_t *hi, uint64_t *lo) {
+	uint64_t words[2];
+	memcpy(words, name, 16);
+	*hi = be64toh(words[0]);
+	*lo = be64toh(words[1]);
+}
+
+// First key not less than (hi, lo)
+int name_index_lower_bound(tracker_t *t, uint64_t hi, uint64_t lo) {
+	int low = 0, high = t->name_count, mid;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (t->name_keys[mid].hi < hi || (t->name_keys[mid].hi == hi && t->name_keys[mid].lo < lo)) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+void name_index_add(tracker_t *t, device_t *node) {
+	uint64_t hi, lo;
+	int i;
+	name_key_load(device_name(t, node), &hi, &lo);
+	i = name_index_lower_bound(t, hi, lo);
+	memmove(&t->name_keys[i + 1], &t->name_keys[i], (t->name_count - i) * sizeof(name_key_t));
+	t->name_keys[i].hi = hi;
+	t->name_keys[i].lo = lo;
+	t->name_keys[i].device = node;
+	t->name_count++;
+}
+
+void name_index_remove(tracker_t *t, device_t *node) {
+	uint64_t hi, lo;
+	int i;
+	name_key_load(device_name(t, node), &hi, &lo);
+	// Devices can share a name, find this one among them
+	for (i = name_index_lower_bound(t, hi, lo); i < t->name_count && t->name_keys[i].device != node; i++);
+	if (i == t->name_count) return;
+	memmove(&t->name_keys[i], &t->name_keys[i + 1], (t->name_count - i - 1) * sizeof(name_key_t));
+	t->name_count--;
+}
+
+/*
+ * Report columns: discovery_time and rssi copied into dense arrays indexed by
+ * pool slot, plus a bit per slot for whether it holds a device, so filters
+ * can compare many devices per instruction instead of chasing the queue.
+ * Rows are rounded up to whole 64-slot words of the live bitmap.
+ */
+#define REPORT_ROWS(capacity) ( ((capacity) + 63) & ~63 )
+#define REPORT_COLUMNS_BYTES(capacity) ( REPORT_ROWS(capacity) * (sizeof(uint64_t) + 1) + REPORT_ROWS(capacity) / 8 )
+
+void columns_update(tracker_t *t, device_t *node) {
+	uint32_t slot = pool_index(t->pool, node);
+	t->col_time[slot] = node->discovery_time;
+	t->col_rssi[slot] = node->adv.rssi;
+}
+
+void columns_add(tracker_t *t, device_t *node) {
+	uint32_t slot = pool_index(t->pool, node);
+	columns_update(t, node);
+	t->col_live[slot / 64] |= 1ULL << (slot % 64);
+}
+
+void columns_remove(tracker_t *t, device_t *node) {
+	uint32_t slot = pool_index(t->pool, node);
+	t->col_live[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+// Returns: the tracked device with this device_id, or NULL
+device_t * tracker_find(tracker_t *t, uint32_t device_id) {
+	device_t *cur;
+	for (cur = device_at(t, t->id_buckets[id_bucket(t, device_id)]); cur != NULL; cur = device_at(t, cur->id_next)) {
+		// device_id is enough to uniquely identify a device
+		if (cur->adv.device_id == device_id) {
+			break;
+		}
+	}
+	return cur;
+}
+
+/*
+ * Find a duplicate device in the queue. This goes through the device_id
+ * index rather than scanning the queue, so it's O(1) after all.
+ * Returns: NULL for no duplicate, or pointer to duplicate
+ */
+device_t * find_duplicate(tracker_t *t, pair_adv_data_t *data) {
+	return tracker_find(t, data->device_id);
+}
+
+/*
+ * Find the tracked device with this rf_address, needs tracker_use_rf_index().
+ * Returns: NULL if there's none (or no index), else the device. If several
+ * share the address, the one that entered the tracker last.
+ */
+device_t * tracker_find_by_rf_address(tracker_t *t, uint32_t rf_address) {
+	uint32_t ref;
+	if (t->rf_buckets == NULL) return NULL;
+	for (ref = t->rf_buckets[id_bucket(t, rf_address)]; ref != 0; ref = t->rf_next[ref - 1]) {
+		if (device_rf_address(t, device_at(t, ref)) == rf_address) break;
+	}
+	return device_at(t, ref);
+}
+
+void queue_remove(tracker_t *t, device_t *node) {
+	if (node != NULL) {
+		device_t *prev = device_at(t, node->prev);
+		device_t *next = device_at(t, node->next);
+		if (t->head == node) t->head = next;
+		if (t->tail == node) t->tail = prev;
+		if (prev != NULL) prev->next = node->next;
+		if (next != NULL) next->prev = node->prev;
+		node->prev = 0;
+		node->next = 0;
+		--t->device_count;
+	}
+}
+
+void queue_push(tracker_t *t, device_t *node) {
+	if (node != NULL) {
+		node->prev = 0;
+		node->next = device_ref(t, t->head);
+		if (t->head != NULL) t->head->prev = device_ref(t, node);
+		t->head = node;
+		if (t->tail == NULL) t->tail = node;
+		++t->device_count;
+	}
+}
+
+device_t * queue_pop(tracker_t *t) {
+	device_t *node = t->tail;
+	if (node != NULL) {
+		t->tail = device_at(t, node->prev);
+		if (t->tail != NULL) t->tail->next = 0;
+		if (t->head == node) t->head = NULL;
+		node->prev = 0;
+		--t->device_count;
+	}
+	return node;
+}
+
+/*
+ * ==========================
+ * Eviction policies
+ * ==========================
+ */
+
+/*
+ * Which device gets pushed out when the tracker is full. LRU is the queue
+ * described at the top; `make bench` replays the same advertisement trace
+ * through each policy to compare them.
+ */
+
+// Shared by every policy: new devices go to the head, victims come from the tail.
+void list_on_insert(tracker_t *t, device_t *node) {
+	queue_push(t, node);
+}
+
+device_t * list_choose_tail(tracker_t *t) {
+	return t->tail;
+}
+
+void list_on_remove(tracker_t *t, device_t *node) {
+	queue_remove(t, node);
+}
+
+// LRU: move duplicates to the front, so the queue stays in order of discovery time.
+void lru_on_hit(tracker_t *t, device_t *node) {
+	queue_remove(t, node);
+	queue_push(t, node);
+}
+
+// FIFO: duplicates keep their place, devices leave in the order they arrived.
+void fifo_on_hit(tracker_t *t, device_t *node) {
+}
+
+// LFU: count observations, evict the least observed device (oldest on ties).
+// Picking the victim is O(n), but only happens when a new device shows up while full.
+void lfu_on_insert(tracker_t *t, device_t *node) {
+	node->hits = 1;
+	queue_push(t, node);
+}
+
+void lfu_on_hit(tracker_t *t, device_t *node) {
+	node->hits++;
+}
+
+device_t * lfu_choose_victim(tracker_t *t) {
+	device_t *cur;
+	device_t *victim = t->tail;
+	for (cur = t->tail; cur != NULL; cur = device_at(t, cur->prev)) {
+		if (cur->hits < victim->hits) victim = cur;
+	}
+	return victim;
+}
+
+// CLOCK, in its second chance form: the tail is the clock hand. A hit only sets
+// the referenced bit, and the hand moves referenced devices back to the head
+// (clearing the bit) until it finds one that hasn't been seen since last sweep.
+void clock_on_insert(tracker_t *t, device_t *node) {
+	node->referenced = 0;
+	queue_push(t, node);
+}
+
+void clock_on_hit(tracker_t *t, device_t *node) {
+	node->referenced = 1;
+}
+
+device_t * clock_choose_victim(tracker_t *t) {
+	device_t *hand = t->tail;
+	while (hand != NULL && hand->referenced) {
+		hand->referenced = 0;
+		queue_remove(t, hand);
+		queue_push(t, hand);
+		hand = t->tail;
+	}
+	return hand;
+}
+
+/*
+ * LRU on top of an append-only observation log instead of the linked list.
+ * Every observation appends a (slot, time) record and tombstones the device's
+ * previous record through log_pos, so the queue never relinks or copies a
+ * device_t. Tombstones get skipped lazily by the tail and squeezed out by
+ * log_compact() once the ring fills up.
+ */
+void log_compact(tracker_t *t) {
+	uint32_t r;
+	uint32_t w = t->log_tail;
+	log_record_t *rec;
+	for (r = t->log_tail; r != t->log_head; r++) {
+		rec = &t->log[r & t->log_mask];
+		if (rec->slot != LOG_TOMBSTONE) {
+			((device_t *)pool_mem(t->pool, rec->slot))->log_pos = w;
+			t->log[w & t->log_mask] = *rec;
+			w++;
+		}
+	}
+	t->log_head = w;
+}
+
+void log_append(tracker_t *t, device_t *node) {
+	log_record_t *rec;
+	if (t->log_head - t->log_tail > t->log_mask) {
+		log_compact(t);
+	}
+	rec = &t->log[t->log_head & t->log_mask];
+	rec->slot = pool_index(t->pool, node);
+	rec->discovery_time = node->discovery_time;
+	node->log_pos = t->log_head++;
+}
+
+void log_on_insert(tracker_t *t, device_t *node) {
+	log_append(t, node);
+	++t->device_count;
+}
+
+void log_on_hit(tracker_t *t, device_t *node) {
+	t->log[node->log_pos & t->log_mask].slot = LOG_TOMBSTONE;
+	log_append(t, node);
+}
+
+device_t * log_choose_victim(tracker_t *t) {
+	while (t->log_tail != t->log_head) {
+		if (t->log[t->log_tail & t->log_mask].slot != LOG_TOMBSTONE) {
+			return pool_mem(t->pool, t->log[t->log_tail & t->log_mask].slot);
+		}
+		t->log_tail++;
+	}
+	return NULL;
+}
+
+void log_on_remove(tracker_t *t, device_t *node) {
+	t->log[node->log_pos & t->log_mask].slot = LOG_TOMBSTONE;
+	--t->device_count;
+}
+
+const eviction_policy_t policy_lru = {
+	"LRU", list_on_insert, lru_on_hit, list_choose_tail, list_on_remove, 1
+};
+
+const eviction_policy_t policy_fifo = {
+	"FIFO", list_on_insert, fifo_on_hit, list_choose_tail, list_on_remove, 0
+};
+
+const eviction_policy_t policy_lfu = {
+	"LFU", lfu_on_insert, lfu_on_hit, lfu_choose_victim, list_on_remove, 0
+};
+
+const eviction_policy_t policy_clock = {
+	"CLOCK", clock_on_insert, clock_on_hit, clock_choose_victim, list_on_remove, 0
+};
+
+const eviction_policy_t policy_log = {
+	"LRU-LOG", log_on_insert, log_on_hit, log_choose_victim, log_on_remove, 1
+};
+
+/*
+ * ==========================
+ * Slot lists
+ * ==========================
+ */
+
+// Put ref at the front of heads[bucket]
+void slot_list_add(uint32_t *heads, slot_link_t *links, uint32_t bucket, uint32_t ref) {
+	slot_link_t *link = &links[ref - 1];
+	link->next = heads[bucket];
+	link->prev = SLOT_LIST_HEAD | bucket;
+	if (heads[bucket] != 0) links[heads[bucket] - 1].prev = ref;
+	heads[bucket] = ref;
+}
+
+// Returns: 1 if ref was on a list and got taken off, else 0
+int slot_list_remove(uint32_t *heads, slot_link_t *links, uint32_t ref) {
+	slot_link_t *link = &links[ref - 1];
+	if (link->prev == 0) return 0;
+	if (link->prev & SLOT_LIST_HEAD) heads[link->prev & ~SLOT_LIST_HEAD] = link->next;
+	else links[link->prev - 1].next = link->next;
+	if (link->next != 0) links[link->next - 1].prev = link->prev;
+	link->next = 0;
+	link->prev = 0;
+	return 1;
+}
+
+/*
+ * ==========================
+ * Expiry timer wheel
+ * ==========================
+ */
+
+/*
+ * Devices are scheduled once, when they're admitted, at the tick their
+ * discovery_time + max_age falls in. Duplicates don't touch the wheel: when a
+ * device comes due, it's expired only if it hasn't been seen since, otherwise
+ * it gets rescheduled from its newer discovery_time. So each observation costs
+ * nothing here and each tick only looks at devices that are actually due.
+ */
+void wheel_add(tracker_t *t, device_t *node) {
+	unsigned long long expires = node->discovery_time + t->max_age_ms;
+	// Round up, so a device is never due before it's actually expired
+	unsigned long long tick = (expires + t->wheel_resolution_ms - 1) / t->wheel_resolution_ms;
+	unsigned long long delta;
+	int level;
+	
+	if (t->wheel_count == 0 && t->wheel_tick < node->discovery_time / t->wheel_resolution_ms) {
+		// Nothing scheduled, so there's nothing to catch up on either
+		t->wheel_tick = node->discovery_time / t->wheel_resolution_ms;
+	}
+	if (tick < t->wheel_tick) tick = t->wheel_tick;
+	delta = tick - t->wheel_tick;
+	if (delta >= WHEEL_SPAN) {
+		// Too far out; it'll come due early and get rescheduled
+		tick = t->wheel_tick + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1)))) break;
+	}
+	slot_list_add(t->wheel, t->timer_links, level * WHEEL_SLOTS + ((tick >> (WHEEL_BITS * level)) & WHEEL_MASK), device_ref(t, node));
+	t->wheel_count++;
+}
+
+void wheel_remove(tracker_t *t, device_t *node) {
+	if (slot_list_remove(t->wheel, t->timer_links, device_ref(t, node))) {
+		t->wheel_count--;
+	}
+}
+
+// Empty a wheel slot; its devices stay chained through next, but none is listed anymore
+uint32_t wheel_take(tracker_t *t, int bucket) {
+	uint32_t first = t->wheel[bucket];
+	uint32_t ref;
+	t->wheel[bucket] = 0;
+	for (ref = first; ref != 0; ref = t->timer_links[ref - 1].next) {
+		t->timer_links[ref - 1].prev = 0;
+		t->wheel_count--;
+	}
+	return first;
+}
+
+// Take every device out of a slot and schedule it again relative to the current tick
+void wheel_cascade(tracker_t *t, int level, int index) {
+	uint32_t ref = wheel_take(t, level * WHEEL_SLOTS + index);
+	uint32_t next;
+	for (; ref != 0; ref = next) {
+		next = t->timer_links[ref - 1].next;
+		wheel_add(t, device_at(t, ref));
+	}
+}
+
+/*
+ * ==========================
+ * RSSI index
+ * ==========================
+ */
+
+/*
+ * One bucket list per RSSI value plus a bitmap of non-empty buckets, so the
+ * strongest devices are always at hand without sorting. Devices only move
+ * when their RSSI changes; within a bucket they're in the order they got there.
+ */
+void rssi_index_add(tracker_t *t, device_t *node) {
+	slot_list_add(t->rssi_bucket, t->rssi_links, node->adv.rssi, device_ref(t, node));
+	t->rssi_bitmap[node->adv.rssi / 64] |= 1ULL << (node->adv.rssi % 64);
+}
+
+void rssi_index_remove(tracker_t *t, device_t *node) {
+	if (slot_list_remove(t->rssi_bucket, t->rssi_links, device_ref(t, node)) && t->rssi_bucket[node->adv.rssi] == 0) {
+		t->rssi_bitmap[node->adv.rssi / 64] &= ~(1ULL << (node->adv.rssi % 64));
+	}
+}
+
+// Strongest non-empty bucket at or below rssi, or -1
+int rssi_index_next_bucket(tracker_t *t, int rssi) {
+	int word = rssi / 64;
+	// Mask off the buckets above rssi in the first word
+	uint64_t bits = t->rssi_bitmap[word] & (~0ULL >> (63 - rssi % 64));
+	for (;;) {
+		if (bits != 0) return word * 64 + 63 - __builtin_clzll(bits);
+		if (--word < 0) return -1;
+		bits = t->rssi_bitmap[word];
+	}
+}
+
+/*
+ * ==========================
+ * Change tracking
+ * ==========================
+ */
+
+/*
+ * Every insert, update and eviction bumps the tracker's generation. Changed
+ * devices move to the front of their own list, and evictions go into a ring,
+ * so finding what changed since a generation only looks at what changed.
+ */
+void changes_unlink(tracker_t *t, uint32_t ref) {
+	change_link_t *link = &t->change_links[ref - 1];
+	if (t->changed_head == ref) t->changed_head = link->next;
+	if (t->changed_tail == ref) t->changed_tail = link->prev;
+	if (link->prev != 0) t->change_links[link->prev - 1].next = link->next;
+	if (link->next != 0) t->change_links[link->next - 1].prev = link->prev;
+	link->prev = 0;
+	link->next = 0;
+}
+
+void changes_push(tracker_t *t, uint32_t ref) {
+	change_link_t *link = &t->change_links[ref - 1];
+	link->prev = 0;
+	link->next = t->changed_head;
+	if (t->changed_head != 0) t->change_links[t->changed_head - 1].prev = ref;
+	t->changed_head = ref;
+	if (t->changed_tail == 0) t->changed_tail = ref;
+}
+
+void changes_insert(tracker_t *t, device_t *node) {
+	uint32_t ref = device_ref(t, node);
+	t->change_links[ref - 1].insert_gen = t->change_links[ref - 1].change_gen = ++t->generation;
+	changes_push(t, ref);
+}
+
+void changes_update(tracker_t *t, device_t *node) {
+	uint32_t ref = device_ref(t, node);
+	t->change_links[ref - 1].change_gen = ++t->generation;
+	if (t->changed_head != ref) {
+		changes_unlink(t, ref);
+		changes_push(t, ref);
+	}
+}
+
+void changes_remove(tracker_t *t, device_t *node) {
+	eviction_record_t *rec = &t->evictions[t->eviction_count++ % EVICTION_LOG_SIZE];
+	changes_unlink(t, device_ref(t, node));
+	if (t->eviction_count > EVICTION_LOG_SIZE) {
+		// Overwriting the oldest record
+		t->evictions_lost_gen = rec->generation;
+	}
+	rec->generation = ++t->generation;
+	rec->device_id = node->adv.device_id;
+}
+
+/*
+ * ==========================
+ * Snapshot table
+ * ==========================
+ */
+
+/*
+ * A compact copy of every tracked device, one record per pool slot, that
+ * reader threads can copy out while on_discovery() keeps running. Each record
+ * is a seqlock: the writer makes seq odd, stores the payload, then makes it
+ * even again, and readers retry if seq was odd or changed under them. The
+ * table has a seqlock of its own too, for readers that want every record
+ * from the same moment. The writer never waits for readers.
+ *
+ * Payload words are relaxed atomics so the racing copy is well defined;
+ * the seq fences give the ordering.
+ */
+#define SNAPSHOT_WORDS 4
+
+typedef struct snapshot_record {
+	_Atomic uint64_t seq;
+	// device_id, rssi, present | device_name[0..8) | device_name[8..16) | discovery_time
+	_Atomic uint64_t words[SNAPSHOT_WORDS];
+} snapshot_record_t;
+
+typedef struct snapshot {
+	// The table seqlock: table_seq, unless the table lives somewhere else (see shm_export_create())
+	_Atomic uint64_t *seq;
+	_Atomic uint64_t table_seq;
+	uint32_t capacity;
+	snapshot_record_t *records;
+	// Writer side: nesting depth of snapshot_batch_begin()
+	uint32_t batch;
+} snapshot_t;
+
+// What readers get back out of a snapshot
+typedef struct snapshot_entry {
+	uint32_t device_id;
+	uint8_t device_name[16];
+	uint8_t rssi;
+	unsigned long long discovery_time;
+} snapshot_entry_t;
+
+// records must have room for the tracker's capacity
+void snapshot_init(snapshot_t *snap, snapshot_record_t *records, uint32_t capacity) {
+	uint32_t i;
+	int w;
+	snap->seq = &snap->table_seq;
+	atomic_init(snap->seq, 0);
+	snap->batch = 0;
+	snap->capacity = capacity;
+	snap->records = records;
+	for (i = 0; i < capacity; i++) {
+		atomic_init(&records[i].seq, 0);
+		for (w = 0; w < SNAPSHOT_WORDS; w++) atomic_init(&records[i].words[w], 0);
+	}
+}
+
+void seqlock_write_begin(_Atomic uint64_t *seq) {
+	atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+void seqlock_write_end(_Atomic uint64_t *seq) {
+	atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Publish a device's current state into its slot, or clear the slot if node is NULL
+void snapshot_write(snapshot_t *snap, uint32_t slot, const tracker_t *t, const device_t *node) {
+	snapshot_record_t *rec = &snap->records[slot];
+	uint64_t words[SNAPSHOT_WORDS] = {0};
+	int w;
+	if (node != NULL) {
+		words[0] = node->adv.device_id | (uint64_t)node->adv.rssi << 32 | 1ULL << 40;
+		memcpy(&words[1], device_name(t, node), 16);
+		words[3] = node->discovery_time;
+	}
+	if (snap->batch == 0) seqlock_write_begin(snap->seq);
+	seqlock_write_begin(&rec->seq);
+	for (w = 0; w < SNAPSHOT_WORDS; w++) {
+		atomic_store_explicit(&rec->words[w], words[w], memory_order_relaxed);
+	}
+	seqlock_write_end(&rec->seq);
+	if (snap->batch == 0) seqlock_write_end(snap->seq);
+}
+
+/*
+ * Writes between these look like one change to consistent readers, like an
+ * eviction and the insert that reuses its slot; they never see the table
+ * one device short in between.
+ */
+void snapshot_batch_begin(snapshot_t *snap) {
+	if (snap->batch++ == 0) seqlock_write_begin(snap->seq);
+}
+
+void snapshot_batch_end(snapshot_t *snap) {
+	if (--snap->batch == 0) seqlock_write_end(snap->seq);
+}
+
+/*
+ * Copy one slot out, retrying until the copy wasn't torn.
+ * Returns: 1 if the slot holds a device, 0 if it's empty
+ */
+int snapshot_read_slot(snapshot_t *snap, uint32_t slot, snapshot_entry_t *out) {
+	snapshot_record_t *rec = &snap->records[slot];
+	uint64_t words[SNAPSHOT_WORDS];
+	uint64_t before, after;
+	int w;
+	do {
+		before = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		for (w = 0; w < SNAPSHOT_WORDS; w++) {
+			words[w] = atomic_load_explicit(&rec->words[w], memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+	
+	if (!(words[0] >> 40 & 1)) return 0;
+	out->device_id = words[0];
+	out->rssi = words[0] >> 32;
+	memcpy(out->device_name, &words[1], 16);
+	out->discovery_time = words[3];
+	return 1;
+}
+
+/*
+ * Copy every tracked device into out (room for the capacity), in slot order.
+ * Each entry is always whole; with consistent set, the entries also all come
+ * from the same moment, retrying the whole copy if the writer got in between.
+ * Returns: number of entries copied
+ */
+int snapshot_read(snapshot_t *snap, snapshot_entry_t *out, int consistent) {
+	uint64_t before;
+	uint32_t slot;
+	int count;
+	for (;;) {
+		before = atomic_load_explicit(snap->seq, memory_order_acquire);
+		if (consistent && (before & 1)) continue;
+		count = 0;
+		for (slot = 0; slot < snap->capacity; slot++) {
+			count += snapshot_read_slot(snap, slot, &out[count]);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (!consistent || atomic_load_explicit(snap->seq, memory_order_relaxed) == before) {
+			return count;
+		}
+	}
+}
+
+/*
+ * ==========================
+ * Trace files
+ * ==========================
+ */
+
+/*
+ * Binary capture of an advertisement stream, for reproducing problems and
+ * sizing the tracker offline:
+ *
+ *   trace_header_t
+ *   trace_record_t  x record_count     one per advertisement, in arrival order
+ *   trace_payload_t x payload_count    at payload_offset
+ *
+ * device_name and device_data never change for a device, so they're stored
+ * once in the payload table and records refer to them by index. All fields
+ * are host order; we only run on little-endian targets.
+ */
+#define TRACE_MAGIC "BLETRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t payload_size;
+	uint32_t payload_count;
+	uint64_t record_count;
+	uint64_t payload_offset;
+} trace_header_t;
+
+typedef struct trace_record {
+	uint64_t timestamp;
+	uint32_t device_id;
+	uint32_t rf_address;
+	uint32_t payload;
+	uint8_t rssi;
+	uint8_t reserved[3];
+} trace_record_t;
+
+typedef struct trace_payload {
+	uint8_t device_name[16];
+	uint8_t device_data[64];
+} trace_payload_t;
+
+_Static_assert(sizeof(trace_header_t) == 40, "trace header layout");
+_Static_assert(sizeof(trace_record_t) == 24, "trace record layout");
+_Static_assert(sizeof(trace_payload_t) == 80, "trace payload layout");
+
+typedef struct trace_recorder {
+	FILE *file;
+	trace_header_t header;
+	// Payload table, written out on close
+	trace_payload_t *payloads;
+	uint32_t payload_capacity;
+	// Open addressing device_id -> payload index + 1 (0 is an empty slot)
+	uint32_t *map_ids;
+	uint32_t *map_payloads;
+	uint32_t map_mask;
+	int failed;
+} trace_recorder_t;
+
+/*
+ * Start a capture. Attach it with tracker_set_recorder().
+ * Returns: 0 on success, -1 if the file can't be created
+ */
+int trace_recorder_open(trace_recorder_t *rec, const char *path) {
+	memset(rec, 0, sizeof(trace_recorder_t));
+	rec->file = fopen(path, "wb");
+	if (rec->file == NULL) {
+		printf("WARNING: can't create trace %s\n", path);
+		return -1;
+	}
+	memcpy(rec->header.magic, TRACE_MAGIC, sizeof(rec->header.magic));
+	rec->header.version = TRACE_VERSION;
+	rec->header.record_size = sizeof(trace_record_t);
+	rec->header.payload_size = sizeof(trace_payload_t);
+	// Placeholder until close fills in the counts
+	if (fwrite(&rec->header, sizeof(trace_header_t), 1, rec->file) != 1) rec->failed = 1;
+	return 0;
+}
+
+uint32_t * trace_map_find(trace_recorder_t *rec, uint32_t device_id) {
+	uint32_t i = (filter_hash(device_id) >> 32) & rec->map_mask;
+	while (rec->map_payloads[i] != 0 && rec->map_ids[i] != device_id) {
+		i = (i + 1) & rec->map_mask;
+	}
+	rec->map_ids[i] = device_id;
+	return &rec->map_payloads[i];
+}
+
+// Keep the map at most half full
+int trace_map_grow(trace_recorder_t *rec) {
+	uint32_t *old_ids = rec->map_ids;
+	uint32_t *old_payloads = rec->map_payloads;
+	uint32_t old_size = old_ids != NULL ? rec->map_mask + 1 : 0;
+	uint32_t size = old_size ? 2 * old_size : 1024;
+	uint32_t i;
+	rec->map_ids = malloc(size * sizeof(uint32_t));
+	rec->map_payloads = calloc(size, sizeof(uint32_t));
+	if (rec->map_ids == NULL || rec->map_payloads == NULL) {
+		free(rec->map_ids);
+		free(rec->map_payloads);
+		rec->map_ids = old_ids;
+		rec->map_payloads = old_payloads;
+		return -1;
+	}
+	rec->map_mask = size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old_payloads[i] != 0) *trace_map_find(rec, old_ids[i]) = old_payloads[i];
+	}
+	free(old_ids);
+	free(old_payloads);
+	return 0;
+}
+
+// Index of the device's payload in the table, adding it the first time the device shows up
+int trace_payload_index(trace_recorder_t *rec, pair_adv_data_t *data, uint32_t *index) {
+	uint32_t *entry;
+	trace_payload_t *payload;
+	if (2 * (rec->header.payload_count + 1) > (rec->map_ids != NULL ? rec->map_mask + 1 : 0)) {
+		if (trace_map_grow(rec) != 0) return -1;
+	}
+	entry = trace_map_find(rec, data->device_id);
+	if (*entry != 0) {
+		payload = &rec->payloads[*entry - 1];
+		if (memcmp(payload->device_name, data->device_name, sizeof(payload->device_name)) == 0 &&
+				memcmp(payload->device_data, data->device_data, sizeof(payload->device_data)) == 0) {
+			*index = *entry - 1;
+			return 0;
+		}
+		// Shouldn't happen, but a device that did change gets a new entry rather than the wrong payload
+	}
+	if (rec->header.payload_count == rec->payload_capacity) {
+		uint32_t capacity = rec->payload_capacity ? 2 * rec->payload_capacity : 256;
+		trace_payload_t *grown = realloc(rec->payloads, capacity * sizeof(trace_payload_t));
+		if (grown == NULL) return -1;
+		rec->payloads = grown;
+		rec->payload_capacity = capacity;
+	}
+	payload = &rec->payloads[rec->header.payload_count];
+	memcpy(payload->device_name, data->device_name, sizeof(payload->device_name));
+	memcpy(payload->device_data, data->device_data, sizeof(payload->device_data));
+	*index = rec->header.payload_count++;
+	*entry = *index + 1;
+	return 0;
+}
+
+void trace_record(trace_recorder_t *rec, pair_adv_data_t *data, unsigned long long timestamp) {
+	trace_record_t record = {0};
+	if (rec->failed) return;
+	if (trace_payload_index(rec, data, &record.payload) != 0) {
+		printf("WARNING: trace payload table out of memory, recording stopped\n");
+		rec->failed = 1;
+		return;
+	}
+	record.timestamp = timestamp;
+	record.device_id = data->device_id;
+	record.rf_address = data->rf_address;
+	record.rssi = data->rssi;
+	if (fwrite(&record, sizeof(record), 1, rec->file) != 1) {
+		printf("WARNING: trace write failed, recording stopped\n");
+		rec->failed = 1;
+		return;
+	}
+	rec->header.record_count++;
+}
+
+/*
+ * Write out the payload table and the final header.
+ * Returns: 0 if the whole capture made it to the file, -1 otherwise
+ */
+int trace_recorder_close(trace_recorder_t *rec) {
+	int failed = rec->failed;
+	rec->header.payload_offset = sizeof(trace_header_t) + rec->header.record_count * sizeof(trace_record_t);
+	if (!failed) {
+		if (fwrite(rec->payloads, sizeof(trace_payload_t), rec->header.payload_count, rec->file) != rec->header.payload_count ||
+				fseek(rec->file, 0, SEEK_SET) != 0 ||
+				fwrite(&rec->header, sizeof(trace_header_t), 1, rec->file) != 1) {
+			failed = 1;
+		}
+	}
+	if (fclose(rec->file) != 0) failed = 1;
+	free(rec->payloads);
+	free(rec->map_ids);
+	free(rec->map_payloads);
+	memset(rec, 0, sizeof(trace_recorder_t));
+	if (failed) printf("WARNING: trace is incomplete\n");
+	return failed ? -1 : 0;
+}
+
+/*
+ * ==========================
+ * Persistent state
+ * ==========================
+ */
+
+/*
+ * A tracker can live in a file mapping so it survives a restart of the
+ * gateway service (see tracker_persist_open()). The file is this header,
+ * the tracker_t, then the tracker memory, all with pointers as they were at
+ * base. While the tracker is changing, in_update is set, so a state left
+ * behind by a crash mid-update is never trusted.
+ */
+#define PERSIST_MAGIC "BLESTATE"
+#define PERSIST_VERSION 1
+// Any change to these structures makes old files unusable
+#define PERSIST_LAYOUT ( (uint32_t)(sizeof(tracker_t) << 16 | sizeof(device_t)) )
+
+typedef struct persist_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t capacity;
+	// Index into persist_policies, function pointers don't survive a restart
+	uint32_t policy;
+	uint64_t base;
+	uint64_t size;
+	volatile uint32_t in_update;
+} persist_header_t;
+
+static inline void persist_begin(tracker_t *t) {
+	if (t->persist == NULL) return;
+	t->persist->in_update = 1;
+	// Only the compiler can reorder against a crash, the page cache keeps the stores
+	atomic_signal_fence(memory_order_seq_cst);
+}
+
+static inline void persist_end(tracker_t *t) {
+	if (t->persist == NULL) return;
+	atomic_signal_fence(memory_order_seq_cst);
+	t->persist->in_update = 0;
+}
+
+/*
+ * ==========================
+ * Device tracker
+ * ==========================
+ */
+
+// Everything a tracker needs besides the tracker_t itself: the device pool, the report scratch space, then the device_id index
+#define TRACKER_ALIGN(bytes) ( ((bytes) + 7) & ~(size_t)7 )
+#define TRACKER_LAYOUT_BYTES(block_size, capacity) ( TRACKER_ALIGN(POOL_BYTES(block_size, capacity)) + \
+		(capacity) * (sizeof(device_t *) + sizeof(uint32_t)) )
+#define DEVICE_BLOCK_BYTES sizeof(device_block_full_t)
+#define TRACKER_BYTES(capacity) TRACKER_LAYOUT_BYTES(DEVICE_BLOCK_BYTES, capacity)
+#define DEVICE_INTERNED_BLOCK_BYTES sizeof(device_block_interned_t)
+#define TRACKER_INTERNED_BYTES(capacity) TRACKER_LAYOUT_BYTES(DEVICE_INTERNED_BLOCK_BYTES, capacity)
+#define DEVICE_METADATA_BLOCK_BYTES sizeof(device_block_metadata_t)
+#define TRACKER_METADATA_BYTES(capacity) TRACKER_LAYOUT_BYTES(DEVICE_METADATA_BLOCK_BYTES, capacity)
+
+// device_t before the tracker profiles, the yardstick for their footprint
+typedef struct device_baseline {
+	pair_adv_data_t adv;
+	unsigned long long discovery_time;
+	struct device_baseline *next;
+	struct device_baseline *prev;
+} device_baseline_t;
+
+uint8_t device_pool[ TRACKER_BYTES(TRACKER_CAPACITY) ];
+
+void tracker_init_blocks(tracker_t *t, uint8_t *mem, int capacity, const eviction_policy_t *policy, size_t block_size) {
+	memset(t, 0, sizeof(*t));
+	t->pool = mem;
+	t->sorted = (const device_t **)&mem[ TRACKER_ALIGN(POOL_BYTES(block_size, capacity)) ];
+	t->id_buckets = (uint32_t *)&t->sorted[capacity];
+	memset(t->id_buckets, 0, capacity * sizeof(uint32_t));
+	t->capacity = capacity;
+	t->policy = policy;
+	t->block_size = block_size;
+	pool_init(t->pool, block_size, capacity);
+}
+
+// mem must hold TRACKER_BYTES(capacity) bytes
+void tracker_init(tracker_t *t, uint8_t *mem, int capacity, const eviction_policy_t *policy) {
+	tracker_init_blocks(t, mem, capacity, policy, DEVICE_BLOCK_BYTES);
+}
+
+/*
+ * A tracker whose devices point into store for their name and data rather
+ * than carrying a copy each, see payload_store_t. mem must hold
+ * TRACKER_INTERNED_BYTES(capacity) bytes. Size the store for the distinct
+ * payloads expected across every tracker using it; a device with a new
+ * payload doesn't get admitted while the store is full.
+ */
+void tracker_init_interned(tracker_t *t, uint8_t *mem, int capacity, const eviction_policy_t *policy, payload_store_t *store) {
+	tracker_init_blocks(t, mem, capacity, policy, DEVICE_INTERNED_BLOCK_BYTES);
+	t->store = store;
+}
+
+/*
+ * A tracker for dashboards: it keeps what the reports show (device_id,
+ * device_name, rssi and age) and drops device_data and rf_address, so each
+ * pool block is well under half of a full one. mem must hold
+ * TRACKER_METADATA_BYTES(capacity) bytes.
+ */
+void tracker_init_metadata(tracker_t *t, uint8_t *mem, int capacity, const eviction_policy_t *policy) {
+	tracker_init_blocks(t, mem, capacity, policy, DEVICE_METADATA_BLOCK_BYTES);
+	t->metadata_only = 1;
+}
+
+/*
+ * Switch an empty tracker to the append-only observation log.
+ * size must be a power of two and at least twice the capacity, so that
+ * compaction always frees up half the ring (amortized O(1) appends).
+ * Returns: 0 on success, -1 if the log can't be used
+ */
+int tracker_use_log(tracker_t *t, log_record_t *records, uint32_t size) {
+	if (t->device_count != 0 || size < 2 * (uint32_t)t->capacity || (size & (size - 1)) != 0) {
+		printf("WARNING: bad observation log size %u for capacity %d\n", size, t->capacity);
+		return -1;
+	}
+	t->log = records;
+	t->log_mask = size - 1;
+	t->log_head = 0;
+	t->log_tail = 0;
+	t->policy = &policy_log;
+	return 0;
+}
+
+// Add a newly admitted device to the queue and whatever else tracks it
+void tracker_link(tracker_t *t, device_t *node) {
+	t->policy->on_insert(t, node);
+	id_index_add(t, node);
+	if (t->rf_buckets != NULL) rf_index_add(t, node);
+	if (t->name_keys != NULL) name_index_add(t, node);
+	if (t->col_live != NULL) columns_add(t, node);
+	if (t->max_age_ms > 0) wheel_add(t, node);
+	if (t->rssi_indexed) rssi_index_add(t, node);
+	if (t->changes_tracked) changes_insert(t, node);
+	if (t->snapshot != NULL) snapshot_write(t->snapshot, pool_index(t->pool, node), t, node);
+}
+
+// Take a device out of everything that tracks it; its memory stays with the caller
+void tracker_unlink(tracker_t *t, device_t *node) {
+	t->policy->on_remove(t, node);
+	id_index_remove(t, node);
+	if (t->rf_buckets != NULL) rf_index_remove(t, node);
+	if (t->name_keys != NULL) name_index_remove(t, node);
+	if (t->col_live != NULL) columns_remove(t, node);
+	if (t->max_age_ms > 0) wheel_remove(t, node);
+	if (t->rssi_indexed) rssi_index_remove(t, node);
+	if (t->changes_tracked) changes_remove(t, node);
+	if (t->snapshot != NULL) snapshot_write(t->snapshot, pool_index(t->pool, node), t, NULL);
+	if (t->store != NULL) payload_release(t->store, device_payload(t, node));
+}
+
+void tracker_set_rssi(tracker_t *t, device_t *node, uint8_t rssi) {
+	if (t->rssi_indexed && node->adv.rssi != rssi) {
+		rssi_index_remove(t, node);
+		node->adv.rssi = rssi;
+		rssi_index_add(t, node);
+	}
+	else {
+		node->adv.rssi = rssi;
+	}
+	if (t->col_rssi != NULL) t->col_rssi[pool_index(t->pool, node)] = rssi;
+}
+
+// Evict one device chosen by the policy and hand its memory back to the caller
+device_t * tracker_evict(tracker_t *t) {
+	device_t *victim = t->policy->choose_victim(t);
+	if (victim != NULL) {
+		tracker_unlink(t, victim);
+	}
+	return victim;
+}
+
+// Capture everything on_discovery() gets from here on, NULL to stop
+void tracker_set_recorder(tracker_t *t, trace_recorder_t *rec) {
+	t->recorder = rec;
+}
+
+// Publish into snap from here on, starting with the devices already tracked; NULL to stop
+void tracker_set_snapshot(tracker_t *t, snapshot_t *snap) {
+	device_t *cur;
+	t->snapshot = snap;
+	if (snap == NULL) return;
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		snapshot_write(snap, pool_index(t->pool, cur), t, cur);
+	}
+}
+
+/*
+ * Keep track of what changed, for tracker_report_changes_since().
+ * Devices already tracked count as inserted at the current generation.
+ * links needs room for the tracker's capacity, or NULL for the memory
+ * already attached (a persistent tracker comes with its own).
+ * Returns: 0 on success, -1 without links
+ */
+int tracker_track_changes(tracker_t *t, change_link_t *links) {
+	device_t *cur;
+	if (t->changes_tracked) return 0;
+	if (links == NULL && t->change_links == NULL) {
+		printf("WARNING: change tracking needs change links\n");
+		return -1;
+	}
+	persist_begin(t);
+	if (links != NULL) t->change_links = links;
+	memset(t->change_links, 0, t->capacity * sizeof(change_link_t));
+	t->changes_tracked = 1;
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		changes_insert(t, cur);
+	}
+	persist_end(t);
+	return 0;
+}
+
+// A bucket per device, then a chain link per pool slot
+#define RF_INDEX_BYTES(capacity) ( 2 * (capacity) * sizeof(uint32_t) )
+
+/*
+ * Keep a hash index on rf_address for tracker_find_by_rf_address(). mem
+ * must hold RF_INDEX_BYTES(capacity) bytes; the devices already tracked get added.
+ * Returns: 0 on success, -1 on a metadata-only tracker, which has no rf_address
+ */
+int tracker_use_rf_index(tracker_t *t, uint32_t *mem) {
+	device_t *cur;
+	if (t->metadata_only) {
+		printf("WARNING: metadata-only trackers don't keep rf_address\n");
+		return -1;
+	}
+	memset(mem, 0, RF_INDEX_BYTES(t->capacity));
+	t->rf_buckets = mem;
+	t->rf_next = &mem[t->capacity];
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		rf_index_add(t, cur);
+	}
+	return 0;
+}
+
+/*
+ * Keep device names sorted for tracker_visit_by_name_prefix(). keys needs
+ * room for the tracker's capacity; the devices already tracked get added.
+ */
+void tracker_use_name_index(tracker_t *t, name_key_t *keys) {
+	device_t *cur;
+	t->name_keys = keys;
+	t->name_count = 0;
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		name_index_add(t, cur);
+	}
+}
+
+/*
+ * Keep report columns for tracker_visit_filtered(). mem must hold
+ * REPORT_COLUMNS_BYTES(capacity) bytes, 8 byte aligned; the devices
+ * already tracked get added.
+ */
+void tracker_use_report_columns(tracker_t *t, uint8_t *mem) {
+	int rows = REPORT_ROWS(t->capacity);
+	device_t *cur;
+	memset(mem, 0, REPORT_COLUMNS_BYTES(t->capacity));
+	t->col_time = (uint64_t *)mem;
+	t->col_live = &t->col_time[rows];
+	t->col_rssi = (uint8_t *)&t->col_live[rows / 64];
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		columns_add(t, cur);
+	}
+}
+
+/*
+ * Keep devices ordered by RSSI as they're updated, so that
+ * tracker_top_k_by_rssi() costs O(k) instead of a pass over every device.
+ * links needs room for the tracker's capacity, or NULL for the memory
+ * already attached (a persistent tracker comes with its own).
+ * Returns: 0 on success, -1 without links
+ */
+int tracker_use_rssi_index(tracker_t *t, slot_link_t *links) {
+	device_t *cur;
+	if (t->rssi_indexed) return 0;
+	if (links == NULL && t->rssi_links == NULL) {
+		printf("WARNING: RSSI index needs slot links\n");
+		return -1;
+	}
+	persist_begin(t);
+	if (links != NULL) t->rssi_links = links;
+	memset(t->rssi_links, 0, t->capacity * sizeof(slot_link_t));
+	t->rssi_indexed = 1;
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		rssi_index_add(t, cur);
+	}
+	persist_end(t);
+	return 0;
+}
+
+/*
+ * Ignore advertisements that arrive less than min_update_ms after a device's
+ * last update. They only fold their RSSI into the existing entry
+ * (RSSI_FOLD_LATEST or RSSI_FOLD_MAX) and are counted in coalesced_count;
+ * the queue, discovery_time and expiry are left alone.
+ * A min_update_ms of 0 turns rate limiting off.
+ */
+void tracker_set_rate_limit(tracker_t *t, unsigned long long min_update_ms, int rssi_fold) {
+	t->min_update_ms = min_update_ms;
+	t->rssi_fold = rssi_fold;
+}
+
+// Drop advertisements the filter rejects before any queue work; NULL tracks everything
+void tracker_set_filter(tracker_t *t, adv_filter_t *filter) {
+	t->filter = filter;
+}
+
+/*
+ * Release devices that haven't been seen for max_age_ms.
+ * resolution_ms is the tick length: devices expire at most that late.
+ * links needs room for the tracker's capacity, or NULL for the memory
+ * already attached (a persistent tracker comes with its own).
+ * A max_age_ms of 0 turns expiry off and needs no links.
+ * Returns: 0 on success, -1 without links
+ */
+int tracker_set_max_age(tracker_t *t, unsigned long long max_age_ms, unsigned long long resolution_ms, slot_link_t *links) {
+	device_t *cur;
+	if (max_age_ms > 0 && links == NULL && t->timer_links == NULL) {
+		printf("WARNING: expiry needs timer links\n");
+		return -1;
+	}
+	persist_begin(t);
+	if (t->max_age_ms > 0) {
+		for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+			wheel_remove(t, cur);
+		}
+	}
+	if (links != NULL) {
+		t->timer_links = links;
+		memset(links, 0, t->capacity * sizeof(slot_link_t));
+	}
+	t->max_age_ms = max_age_ms;
+	t->wheel_resolution_ms = resolution_ms > 0 ? resolution_ms : 1;
+	if (max_age_ms > 0) {
+		for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+			wheel_add(t, cur);
+		}
+	}
+	persist_end(t);
+	return 0;
+}
+
+/*
+ * Advance the expiry wheel to now, releasing expired devices back to the pool.
+ * Call it from the ingestion loop, or from a housekeeping thread holding
+ * whatever lock serializes on_discovery().
+ * Returns: number of devices expired
+ */
+int tracker_expire(tracker_t *t, unsigned long long now) {
+	unsigned long long target = now / t->wheel_resolution_ms;
+	uint32_t ref, next;
+	device_t *node;
+	int expired = 0;
+	int index;
+	
+	if (t->max_age_ms == 0) return 0;
+	persist_begin(t);
+	while (t->wheel_tick <= target) {
+		if (t->wheel_count == 0) {
+			t->wheel_tick = target + 1;
+			break;
+		}
+		index = t->wheel_tick & WHEEL_MASK;
+		// Going around level 0 pulls the next slot of level 1 down, and so on up
+		if (index == 0) {
+			int level;
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				int upper = (t->wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+				wheel_cascade(t, level, upper);
+				if (upper != 0) break;
+			}
+		}
+		
+		ref = wheel_take(t, index);
+		t->wheel_tick++;
+		for (; ref != 0; ref = next) {
+			next = t->timer_links[ref - 1].next;
+			node = device_at(t, ref);
+			if (node->discovery_time + t->max_age_ms <= now) {
+				tracker_unlink(t, node);
+				pool_free(t->pool, node);
+				expired++;
+			}
+			else {
+				wheel_add(t, node);
+			}
+		}
+	}
+	t->expired_count += expired;
+	persist_end(t);
+	return expired;
+}
+
+void queue_clear(tracker_t *t) {
+	device_t *node;
+	while ((node = tracker_evict(t)) != NULL) {
+		pool_free(t->pool, node);
+	}
+}
+
+void tracker_destroy(tracker_t *t) {
+	queue_clear(t);
+	pool_destroy(t->pool);
+}
+
+/*
+ * ==========================
+ * Device discovery and printing
+ * ==========================
+ */
+
+// Start tracking a device that isn't tracked yet, evicting one if full
+device_t * tracker_insert(tracker_t *t, pair_adv_data_t *data, unsigned long long timestamp) {
+	const device_payload_t *payload = NULL;
+	device_t *new;
+	
+	// This protects against an edge case 
+	// where we somehow get more than capacity devices
+	// in the list. Shouldn't happen unless there's a bug.
+	while (t->device_count > t->capacity) {
+		printf("WARNING: large device_count %d\n", t->device_count);
+		pool_free(t->pool, tracker_evict(t));
+	}
+	// The payload comes first, so a full store doesn't cost a device for nothing
+	if (t->store != NULL && (payload = payload_intern(t->store, data->device_name, data->device_data)) == NULL) {
+		// Unless the victim holds the last reference to its payload: evicting it frees an entry
+		new = t->device_count == t->capacity ? t->policy->choose_victim(t) : NULL;
+		if (new == NULL || ((const payload_entry_t *)device_payload(t, new))->refs > 1) {
+			printf("WARNING: payload store full, device %u not tracked\n", data->device_id);
+			return NULL;
+		}
+		tracker_unlink(t, new);
+		payload = payload_intern(t->store, data->device_name, data->device_data);
+	}
+	else if (t->device_count == t->capacity) {
+		// reuse the victim's slot instead of reallocating
+		new = tracker_evict(t);
+	}
+	else {
+		new = pool_alloc(t->pool, t->block_size);
+	}
+	if (new == NULL) {
+		if (payload != NULL) payload_release(t->store, payload);
+		printf("WARNING: out of device memory\n");
+		return NULL;
+	}
+	memset(new, 0, sizeof(device_t));
+	new->adv.device_id = data->device_id;
+	new->adv.rssi = data->rssi;
+	if (t->metadata_only) {
+		memcpy(((device_block_metadata_t *)new)->device_name, data->device_name, sizeof(data->device_name));
+	}
+	else if (t->store != NULL) {
+		((device_block_interned_t *)new)->payload = payload;
+		((device_block_interned_t *)new)->rf_address = data->rf_address;
+	}
+	else {
+		memcpy(((device_block_full_t *)new)->payload.device_name, data->device_name, sizeof(data->device_name));
+		memcpy(((device_block_full_t *)new)->payload.device_data, data->device_data, sizeof(data->device_data));
+		((device_block_full_t *)new)->rf_address = data->rf_address;
+	}
+	new->discovery_time = timestamp;
+	tracker_link(t, new);
+	return new;
+}
+
+void on_discovery_at(tracker_t *t, pair_adv_data_t *data, unsigned long long timestamp) {
+	device_t *dupe;
+	
+	// Recorded before filtering, so a replay can try other filters
+	if (t->recorder != NULL) trace_record(t->recorder, data, timestamp);
+	if (t->filter != NULL && !filter_accepts(t->filter, data)) {
+		return;
+	}
+	persist_begin(t);
+	dupe = find_duplicate(t, data); // O(1)
+
+	if (dupe != NULL && timestamp - dupe->discovery_time < t->min_update_ms) {
+		// Too soon after the last update: fold it in without any list mutation
+		if ((t->rssi_fold == RSSI_FOLD_LATEST || data->rssi > dupe->adv.rssi) && data->rssi != dupe->adv.rssi) {
+			tracker_set_rssi(t, dupe, data->rssi);
+			if (t->changes_tracked) changes_update(t, dupe);
+			if (t->snapshot != NULL) snapshot_write(t->snapshot, pool_index(t->pool, dupe), t, dupe);
+		}
+		t->coalesced_count++;
+	}
+	else if (dupe != NULL){
+		tracker_set_rssi(t, dupe, data->rssi);
+		dupe->discovery_time = timestamp;
+		if (t->col_time != NULL) t->col_time[pool_index(t->pool, dupe)] = timestamp;
+		t->policy->on_hit(t, dupe);
+		if (t->changes_tracked) changes_update(t, dupe);
+		if (t->snapshot != NULL) snapshot_write(t->snapshot, pool_index(t->pool, dupe), t, dupe);
+	}
+	else if (t->snapshot != NULL)
+	{
+		snapshot_batch_begin(t->snapshot);
+		tracker_insert(t, data, timestamp);
+		snapshot_batch_end(t->snapshot);
+	}
+	else
+	{
+		tracker_insert(t, data, timestamp);
+	}
+	persist_end(t);
+}
+
+void on_discovery(tracker_t *t, pair_adv_data_t *data) {
+	on_discovery_at(t, data, systime_ms_get());
+}
+
+void print_queue_by_time(tracker_t *t) {
+	device_t *cur;
+	printf("Devices ordered by time (queue ordering):\n");
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		printf("time: %llu\tdev: %d\trssi: %d\n", 
+				cur->discovery_time, 
+				cur->adv.device_id,
+				cur->adv.rssi);
+	}
+}
+
+/*
+ * ==========================
+ * Reports
+ * ==========================
+ */
+
+/*
+ * Sort the tracked devices into t->sorted, strongest first. RSSI is only 8 bits,
+ * so a counting sort does it in O(n) and keeps queue order among equal RSSI.
+ * Returns: number of devices sorted
+ */
+int tracker_sort_by_rssi(tracker_t *t) {
+	int start[256] = {0};
+	int count = 0;
+	int rssi, next;
+	device_t *cur;
+	
+	for (cur = queue_first(t); cur != NULL && count < t->capacity; cur = queue_next(t, cur)) {
+		start[cur->adv.rssi]++;
+		count++;
+	}
+	if (cur != NULL) {
+		printf("WARNING: large device_count %d\n", t->device_count);
+	}
+	for (rssi = 255, next = 0; rssi >= 0; rssi--) {
+		int n = start[rssi];
+		start[rssi] = next;
+		next += n;
+	}
+	for (cur = queue_first(t); cur != NULL && next > 0; cur = queue_next(t, cur), next--) {
+		t->sorted[start[cur->adv.rssi]++] = cur;
+	}
+	return count;
+}
+
+/*
+ * The selection step of a top k by RSSI, given how many items there are
+ * at each RSSI: find the weakest RSSI that still makes the cut, then turn
+ * count[] into the output position of the next item at each RSSI down to
+ * the cut, so a second pass places items straight where they go.
+ * Only at_cut items at the cut RSSI fit; k drops if there are fewer than k items.
+ * Returns: the cut RSSI
+ */
+int top_k_positions(int count[256], int *k, int *at_cut) {
+	int rssi, cut, above, n;
+	// Find the cut: everything above it makes it, only some of the devices at it might
+	for (cut = 255, above = 0; cut > 0 && above + count[cut] < *k; cut--) {
+		above += count[cut];
+	}
+	if (above + count[cut] < *k) *k = above + count[cut];
+	*at_cut = *k - above;
+	for (rssi = 255, n = 0; rssi > cut; rssi--) {
+		int c = count[rssi];
+		count[rssi] = n;
+		n += c;
+	}
+	count[cut] = n;
+	return cut;
+}
+
+/*
+ * The k strongest devices, strongest first, into out (room for k).
+ * With the RSSI index that's a walk down the buckets, O(k). Without it, a
+ * counting pass finds the weakest RSSI that still makes the cut and a second
+ * pass picks the devices, O(n) with no sort. Ties come out in the same order
+ * as tracker_sort_by_rssi() (for the index: the order they got their RSSI).
+ * Returns: number of devices written, at most k
+ */
+int tracker_top_k_by_rssi(tracker_t *t, int k, const device_t **out) {
+	int count[256] = {0};
+	int n = 0;
+	int rssi, cut, at_cut;
+	device_t *cur;
+	uint32_t ref;
+	
+	if (k <= 0) return 0;
+	if (t->rssi_indexed) {
+		for (rssi = rssi_index_next_bucket(t, 255); rssi >= 0 && n < k; rssi = rssi_index_next_bucket(t, rssi - 1)) {
+			for (ref = t->rssi_bucket[rssi]; ref != 0 && n < k; ref = t->rssi_links[ref - 1].next) {
+				out[n++] = device_at(t, ref);
+			}
+			if (rssi == 0) break;
+		}
+		return n;
+	}
+	
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		count[cur->adv.rssi]++;
+	}
+	cut = top_k_positions(count, &k, &at_cut);
+	
+	// Place devices straight into their final position, like the counting sort does
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		if (cur->adv.rssi > cut) {
+			out[count[cur->adv.rssi]++] = cur;
+		}
+		else if (cur->adv.rssi == cut && at_cut > 0) {
+			out[count[cut]++] = cur;
+			at_cut--;
+		}
+	}
+	return k;
+}
+
+/*
+ * Delta reports
+ */
+#define CHANGE_INSERTED 1
+#define CHANGE_UPDATED 2
+#define CHANGE_EVICTED 3
+
+typedef struct device_change {
+	int kind;
+	uint32_t device_id;
+	// NULL for evicted devices
+	const device_t *device;
+	unsigned long long generation;
+} device_change_t;
+
+// Return nonzero to stop the walk
+typedef int (*change_visitor_t)(const device_change_t *change, void *ctx);
+
+/*
+ * Visit everything that changed after generation since: evictions first,
+ * then inserted and updated devices, most recent first. Costs O(changes).
+ * Save t->generation alongside the report and pass it in next time.
+ * Returns: number of changes visited, or -1 if since is too old for the
+ * eviction log (or change tracking is off) and a full report is needed
+ */
+int tracker_report_changes_since(tracker_t *t, unsigned long long since, change_visitor_t visit, void *ctx) {
+	device_change_t change;
+	const change_link_t *link;
+	unsigned long long i;
+	uint32_t ref;
+	int count = 0;
+	
+	if (!t->changes_tracked || since < t->evictions_lost_gen) {
+		return -1;
+	}
+	for (i = t->eviction_count; i > 0; i--) {
+		eviction_record_t *rec = &t->evictions[(i - 1) % EVICTION_LOG_SIZE];
+		if (rec->generation <= since || t->eviction_count - i >= EVICTION_LOG_SIZE) break;
+		change.kind = CHANGE_EVICTED;
+		change.device_id = rec->device_id;
+		change.device = NULL;
+		change.generation = rec->generation;
+		count++;
+		if (visit(&change, ctx)) return count;
+	}
+	for (ref = t->changed_head; ref != 0 && t->change_links[ref - 1].change_gen > since; ref = link->next) {
+		link = &t->change_links[ref - 1];
+		change.kind = link->insert_gen > since ? CHANGE_INSERTED : CHANGE_UPDATED;
+		change.device = device_at(t, ref);
+		change.device_id = change.device->adv.device_id;
+		change.generation = link->change_gen;
+		count++;
+		if (visit(&change, ctx)) break;
+	}
+	return count;
+}
+
+// In-place heapsort of a[0..count) by discovery_time, most recent first
+void sorted_sift_down(const device_t **a, int root, int count) {
+	int child;
+	const device_t *temp;
+	while ((child = 2 * root + 1) < count) {
+		// Min-heap, so the oldest ends up at the back
+		if (child + 1 < count && a[child + 1]->discovery_time < a[child]->discovery_time) child++;
+		if (a[root]->discovery_time <= a[child]->discovery_time) break;
+		temp = a[root];
+		a[root] = a[child];
+		a[child] = temp;
+		root = child;
+	}
+}
+
+void sorted_heapsort(const device_t **a, int count) {
+	const device_t *temp;
+	int i;
+	for (i = count / 2 - 1; i >= 0; i--) {
+		sorted_sift_down(a, i, count);
+	}
+	for (i = count - 1; i > 0; i--) {
+		temp = a[0];
+		a[0] = a[i];
+		a[i] = temp;
+		sorted_sift_down(a, 0, i);
+	}
+}
+
+/*
+ * Put the tracked devices into t->sorted, most recently seen first. That's
+ * already queue order with a time ordered policy, the others get heapsorted.
+ * Returns: number of devices sorted
+ */
+int tracker_sort_by_time(tracker_t *t) {
+	device_t *cur;
+	int count = 0;
+	
+	for (cur = queue_first(t); cur != NULL && count < t->capacity; cur = queue_next(t, cur)) {
+		t->sorted[count++] = cur;
+	}
+	if (!t->policy->time_ordered) {
+		sorted_heapsort(t->sorted, count);
+	}
+	return count;
+}
+
+/*
+ * What a report gets to see of a device. It points into the tracker,
+ * so it's only valid until the next on_discovery().
+ */
+typedef struct device_view {
+	const device_t *device;
+	uint32_t device_id;
+	const uint8_t *device_name;
+	uint8_t rssi;
+	unsigned long long age_ms;
+} device_view_t;
+
+// Return nonzero to stop the walk
+typedef int (*device_visitor_t)(const device_view_t *view, void *ctx);
+
+void device_view_init(device_view_t *view, const tracker_t *t, const device_t *dev, unsigned long long now) {
+	view->device = dev;
+	view->device_id = dev->adv.device_id;
+	view->device_name = device_name(t, dev);
+	view->rssi = dev->adv.rssi;
+	view->age_ms = now > dev->discovery_time ? now - dev->discovery_time : 0;
+}
+
+int tracker_visit_sorted(tracker_t *t, int count, unsigned long long now, device_visitor_t visit, void *ctx) {
+	device_view_t view;
+	int i;
+	for (i = 0; i < count; i++) {
+		device_view_init(&view, t, t->sorted[i], now);
+		if (visit(&view, ctx)) return i + 1;
+	}
+	return count;
+}
+
+/*
+ * Walk the tracked devices, most recently seen first, without copying or
+ * allocating anything. Ages are relative to now, so read the clock once per report.
+ * Returns: number of devices visited
+ */
+int tracker_visit_by_time(tracker_t *t, unsigned long long now, device_visitor_t visit, void *ctx) {
+	device_view_t view;
+	device_t *cur;
+	int count = 0;
+	if (!t->policy->time_ordered) {
+		return tracker_visit_sorted(t, tracker_sort_by_time(t), now, visit, ctx);
+	}
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		device_view_init(&view, t, cur, now);
+		count++;
+		if (visit(&view, ctx)) break;
+	}
+	return count;
+}
+
+// Same, strongest RSSI first
+int tracker_visit_by_rssi(tracker_t *t, unsigned long long now, device_visitor_t visit, void *ctx) {
+	return tracker_visit_sorted(t, tracker_sort_by_rssi(t), now, visit, ctx);
+}
+
+// A name prefix as masked name keys: name matches when (key & mask) == prefix key
+typedef struct name_prefix {
+	uint64_t hi;
+	uint64_t lo;
+	uint64_t mask_hi;
+	uint64_t mask_lo;
+} name_prefix_t;
+
+// Returns: 0 on success, -1 if the prefix is longer than a name
+int name_prefix_init(name_prefix_t *match, const void *prefix, size_t len) {
+	uint8_t padded[16] = {0};
+	uint8_t mask[16] = {0};
+	if (len > sizeof(padded)) return -1;
+	memcpy(padded, prefix, len);
+	memset(mask, 0xff, len);
+	name_key_load(padded, &match->hi, &match->lo);
+	name_key_load(mask, &match->mask_hi, &match->mask_lo);
+	return 0;
+}
+
+int name_prefix_matches(const name_prefix_t *match, const uint8_t *name) {
+	uint64_t hi, lo;
+	name_key_load(name, &hi, &lo);
+	return (hi & match->mask_hi) == match->hi && (lo & match->mask_lo) == match->lo;
+}
+
+/*
+ * Visit the devices whose name starts with prefix (len bytes, at most 16).
+ * With tracker_use_name_index() that's a binary search to the first match
+ * and a walk over the matches, in name order; otherwise a scan in queue order.
+ * Returns: number of devices visited
+ */
+int tracker_visit_by_name_prefix(tracker_t *t, const void *prefix, size_t len, unsigned long long now, device_visitor_t visit, void *ctx) {
+	name_prefix_t match;
+	device_view_t view;
+	device_t *cur;
+	int count = 0;
+	int i;
+	
+	if (name_prefix_init(&match, prefix, len) != 0) return 0;
+	if (t->name_keys != NULL) {
+		// The prefix padded with zeros sorts right before everything it's a prefix of
+		for (i = name_index_lower_bound(t, match.hi, match.lo); i < t->name_count; i++) {
+			if ((t->name_keys[i].hi & match.mask_hi) != match.hi || (t->name_keys[i].lo & match.mask_lo) != match.lo) break;
+			device_view_init(&view, t, t->name_keys[i].device, now);
+			count++;
+			if (visit(&view, ctx)) break;
+		}
+		return count;
+	}
+	for (cur = queue_first(t); cur != NULL; cur = queue_next(t, cur)) {
+		if (!name_prefix_matches(&match, device_name(t, cur))) continue;
+		device_view_init(&view, t, cur, now);
+		count++;
+		if (visit(&view, ctx)) break;
+	}
+	return count;
+}
+
+#define REPORT_BY_TIME 0
+#define REPORT_BY_RSSI 1
+
+/*
+ * What tracker_visit_filtered() lets through: at least min_rssi, seen within
+ * max_age_ms (0 for any age) and, when name_prefix isn't NULL, a name
+ * starting with its name_len bytes.
+ */
+typedef struct report_filter {
+	uint8_t min_rssi;
+	unsigned long long max_age_ms;
+	const void *name_prefix;
+	size_t name_len;
+} report_filter_t;
+
+// Eight slots per compare: the RSSI lanes get widened to line up with the time lanes
+typedef uint8_t rssi_lanes_t __attribute__((vector_size(8)));
+typedef uint64_t time_lanes_t __attribute__((vector_size(64)));
+typedef int64_t mask_lanes_t __attribute__((vector_size(64)));
+
+/*
+ * Evaluate the RSSI and age predicates for the 64 slots of one live bitmap
+ * word straight off the columns, no branches per device.
+ * Returns: bit n set when slot word * 64 + n holds a device that passes
+ */
+uint64_t columns_select(tracker_t *t, int word, uint8_t min_rssi, uint64_t oldest) {
+	const mask_lanes_t weights = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	rssi_lanes_t rssi;
+	time_lanes_t seen;
+	mask_lanes_t pass;
+	uint64_t bits = 0;
+	int lane;
+	
+	if (t->col_live[word] == 0) return 0;
+	for (lane = 0; lane < 64; lane += 8) {
+		memcpy(&rssi, &t->col_rssi[word * 64 + lane], sizeof(rssi));
+		memcpy(&seen, &t->col_time[word * 64 + lane], sizeof(seen));
+		pass = __builtin_convertvector(rssi >= min_rssi, mask_lanes_t) & (seen >= oldest);
+		// Each passing lane keeps its own bit, then the lanes fold into one byte
+		pass &= weights;
+		bits |= (uint64_t)(pass[0] | pass[1] | pass[2] | pass[3] | pass[4] | pass[5] | pass[6] | pass[7]) << lane;
+	}
+	return bits & t->col_live[word];
+}
+
+/*
+ * Sort a[0..count) strongest RSSI first, in place: count per RSSI, then
+ * swap every device into its RSSI's region. O(n) like tracker_sort_by_rssi(),
+ * without needing a second array.
+ */
+void sorted_flag_sort_by_rssi(const device_t **a, int count) {
+	int next[256] = {0};
+	int end[256];
+	const device_t *temp;
+	int rssi, pos, i;
+	
+	for (i = 0; i < count; i++) {
+		next[a[i]->adv.rssi]++;
+	}
+	for (rssi = 255, pos = 0; rssi >= 0; rssi--) {
+		int n = next[rssi];
+		next[rssi] = pos;
+		pos += n;
+		end[rssi] = pos;
+	}
+	for (rssi = 255; rssi >= 0; rssi--) {
+		while (next[rssi] < end[rssi]) {
+			temp = a[next[rssi]];
+			if (temp->adv.rssi == rssi) {
+				next[rssi]++;
+				continue;
+			}
+			a[next[rssi]] = a[next[temp->adv.rssi]];
+			a[next[temp->adv.rssi]++] = temp;
+		}
+	}
+}
+
+/*
+ * Visit the devices that pass filter, REPORT_BY_RSSI or REPORT_BY_TIME.
+ * With tracker_use_report_columns() RSSI and age are compared eight slots
+ * at a time into a selection bitmask, and only the selected devices get
+ * touched, name checked and sorted; otherwise it's a walk of the queue.
+ * Ties come out in no particular order.
+ * Returns: number of devices visited
+ */
+int tracker_visit_filtered(tracker_t *t, const report_filter_t *filter, int order, unsigned long long now, device_visitor_t visit, void *ctx) {
+	uint64_t oldest = 0;
+	uint64_t selected;
+	name_prefix_t match;
+	const device_t *dev;
+	device_t *cur;
+	int count = 0;
+	int word;
+	
+	if (filter->name_prefix != NULL && name_prefix_init(&match, filter->name_prefix, filter->name_len) != 0) return 0;
+	if (filter->max_age_ms > 0 && now > filter->max_age_ms) oldest = now - filter->max_age_ms;
+	
+	if (t->col_live != NULL) {
+		for (word = 0; word < REPORT_ROWS(t->capacity) / 64; word++) {
+			for (selected = columns_select(t, word, filter->min_rssi, oldest); selected != 0; selected &= selected - 1) {
+				dev = pool_mem(t->pool, word * 64 + __builtin_ctzll(selected));
+				if (filter->name_prefix != NULL && !name_prefix_matches(&match, device_name(t, dev))) continue;
+				t->sorted[count++] = dev;
+			}
+		}
+	}
+	else {
+		for (cur = queue_first(t); cur != NULL && count < t->capacity; cur = queue_next(t, cur)) {
+			if (cur->adv.rssi < filter->min_rssi || cur->discovery_time < oldest) continue;
+			if (filter->name_prefix != NULL && !name_prefix_matches(&match, device_name(t, cur))) continue;
+			t->sorted[count++] = cur;
+		}
+	}
+	if (order == REPORT_BY_RSSI) sorted_flag_sort_by_rssi(t->sorted, count);
+	else sorted_heapsort(t->sorted, count);
+	return tracker_visit_sorted(t, count, now, visit, ctx);
+}
+
+/*
+ * One report over several trackers that can see the same device, like one
+ * tracker per radio on a multi-antenna gateway. Each device comes out once,
+ * strongest first, with its best RSSI (view->device is that copy) and the age
+ * of its latest sighting on any radio.
+ * Every tracker gets counting sorted, then a heap of per-tracker cursors
+ * merges them. A copy is skipped when another tracker has the same device
+ * stronger, or just as strong and earlier in trackers[]; the device_id index
+ * answers that, so there's no seen-set to size.
+ * Returns: number of devices visited
+ */
+int tracker_merge_visit_by_rssi(tracker_t **trackers, int count, unsigned long long now, device_visitor_t visit, void *ctx) {
+	// The arrays below are sized by count, and a zero length one is undefined
+	if (count <= 0) return 0;
+	int heap[count];
+	int pos[count];
+	int sorted[count];
+	int heap_size = 0;
+	int visited = 0;
+	unsigned long long latest;
+	const device_t *dev;
+	device_t *dupe;
+	device_view_t view;
+	int i, j, top, child;
+	
+	// Heap order: stronger next device first, lower tracker index on ties
+	#define MERGE_HEAD_RSSI(r) ( trackers[r]->sorted[pos[r]]->adv.rssi )
+	#define MERGE_BEFORE(a, b) ( MERGE_HEAD_RSSI(a) > MERGE_HEAD_RSSI(b) || (MERGE_HEAD_RSSI(a) == MERGE_HEAD_RSSI(b) && (a) < (b)) )
+	for (i = 0; i < count; i++) {
+		pos[i] = 0;
+		sorted[i] = tracker_sort_by_rssi(trackers[i]);
+		if (sorted[i] == 0) continue;
+		child = heap_size++;
+		while (child > 0 && MERGE_BEFORE(i, heap[(child - 1) / 2])) {
+			heap[child] = heap[(child - 1) / 2];
+			child = (child - 1) / 2;
+		}
+		heap[child] = i;
+	}
+	while (heap_size > 0) {
+		top = heap[0];
+		dev = trackers[top]->sorted[pos[top]];
+		latest = dev->discovery_time;
+		for (j = 0; j < count; j++) {
+			if (j == top) continue;
+			dupe = tracker_find(trackers[j], dev->adv.device_id);
+			if (dupe == NULL) continue;
+			if (dupe->adv.rssi > dev->adv.rssi || (dupe->adv.rssi == dev->adv.rssi && j < top)) break;
+			if (dupe->discovery_time > latest) latest = dupe->discovery_time;
+		}
+		if (j == count) {
+			device_view_init(&view, trackers[top], dev, now);
+			view.age_ms = now > latest ? now - latest : 0;
+			visited++;
+			if (visit(&view, ctx)) break;
+		}
+		
+		// Advance the top tracker, or drop it from the heap once it runs out
+		if (++pos[top] == sorted[top]) {
+			top = heap[--heap_size];
+		}
+		for (i = 0; (child = 2 * i + 1) < heap_size; i = child) {
+			if (child + 1 < heap_size && MERGE_BEFORE(heap[child + 1], heap[child])) child++;
+			if (!MERGE_BEFORE(heap[child], top)) break;
+			heap[i] = heap[child];
+		}
+		if (heap_size > 0) heap[i] = top;
+	}
+	#undef MERGE_BEFORE
+	#undef MERGE_HEAD_RSSI
+	return visited;
+}
+
+/*
+ * ==========================
+ * Table renderer
+ * ==========================
+ */
+
+/*
+ * Formats the report table by hand into one buffer, so printing it is a
+ * single write() instead of a printf (and maybe a console flush) per row.
+ */
+// Longest row: 10 digit id, 16 byte name, 3 digit rssi, 20 digit age, separators
+#define RENDER_ROW_MAX 64
+#define RENDER_HEADER "device_id\tdevice_name\trssi\tage_ms\n"
+
+typedef struct render_ctx {
+	char *buf;
+	size_t size;
+	size_t len;
+	// Where to flush a full buffer to, or -1 to stop at the end of the buffer
+	int fd;
+	int truncated;
+} render_ctx_t;
+
+char * render_u64(char *out, unsigned long long value) {
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	while (n > 0) *out++ = digits[--n];
+	return out;
+}
+
+// device_name is a fixed 16 bytes, only NUL terminated when shorter
+char * render_name(char *out, const uint8_t *name) {
+	int i;
+	for (i = 0; i < 16 && name[i] != 0; i++) {
+		*out++ = (name[i] >= ' ' && name[i] < 127) ? name[i] : '?';
+	}
+	return out;
+}
+
+void render_flush(render_ctx_t *ctx) {
+	size_t done = 0;
+	ssize_t n;
+	while (done < ctx->len) {
+		n = write(ctx->fd, ctx->buf + done, ctx->len - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	ctx->len = 0;
+}
+
+int render_row_visitor(const device_view_t *view, void *ctx_ptr) {
+	render_ctx_t *ctx = ctx_ptr;
+	char *out;
+	if (ctx->size - ctx->len < RENDER_ROW_MAX) {
+		if (ctx->fd < 0) {
+			ctx->truncated = 1;
+			return 1;
+		}
+		render_flush(ctx);
+	}
+	out = ctx->buf + ctx->len;
+	out = render_u64(out, view->device_id);
+	*out++ = '\t';
+	out = render_name(out, view->device_name);
+	*out++ = '\t';
+	out = render_u64(out, view->rssi);
+	*out++ = '\t';
+	out = render_u64(out, view->age_ms);
+	*out++ = '\n';
+	ctx->len = out - ctx->buf;
+	return 0;
+}
+
+void render_table(tracker_t *t, int order, unsigned long long now, render_ctx_t *ctx) {
+	memcpy(ctx->buf, RENDER_HEADER, sizeof(RENDER_HEADER) - 1);
+	ctx->len = sizeof(RENDER_HEADER) - 1;
+	if (order == REPORT_BY_RSSI) {
+		tracker_visit_by_rssi(t, now, render_row_visitor, ctx);
+	} else {
+		tracker_visit_by_time(t, now, render_row_visitor, ctx);
+	}
+}
+
+/*
+ * Render the table into buf, REPORT_BY_RSSI or REPORT_BY_TIME.
+ * Rows that don't fit are left out; size RENDER_ROW_MAX per device (plus one for the header) fits them all.
+ * Returns: number of bytes written, not NUL terminated
+ */
+size_t tracker_render_table(tracker_t *t, int order, unsigned long long now, char *buf, size_t size) {
+	render_ctx_t ctx = { buf, size, 0, -1, 0 };
+	if (size < RENDER_ROW_MAX) return 0;
+	render_table(t, order, now, &ctx);
+	return ctx.len;
+}
+
+// Render the table and write it to fd, in one write() unless it's over 4 KB
+void tracker_write_table(tracker_t *t, int order, int fd) {
+	char buf[4096];
+	render_ctx_t ctx = { buf, sizeof(buf), 0, fd, 0 };
+	render_table(t, order, systime_ms_get(), &ctx);
+	render_flush(&ctx);
+}
+
+void print_queue_by_rssi(tracker_t *t) {
+	printf("Devices ordered by RSSI (descending):\n");
+	fflush(stdout);
+	tracker_write_table(t, REPORT_BY_RSSI, STDOUT_FILENO);
+}
+
+/*
+ * ==========================
+ * Serialization
+ * ==========================
+ */
+
+/*
+ * The device table as a compact byte string, to hand to another process or
+ * keep as a checkpoint. Byte order is defined, so it reads back anywhere:
+ *
+ *   "BLES" | version u8 | flags u8 | count varint | oldest time varint
+ *   then per device, from the back of the queue to the front:
+ *     device_id varint | time delta from the previous device, zigzag varint |
+ *     rssi u8 | rf_address u32 little-endian |
+ *     with SERIALIZE_PAYLOAD: name length u8 + name, data length u8 + data
+ *
+ * Going back to front means a restore is just inserting in order, which
+ * rebuilds the queue, whatever the policy, along with the indexes. With LRU
+ * the deltas are all small and positive. Other policies can go back in time,
+ * hence the zigzag. Name and data are cut at their trailing zeros.
+ * Policy state other than queue order (LFU hit counts, CLOCK bits) isn't kept.
+ */
+#define SERIALIZE_MAGIC "BLES"
+#define SERIALIZE_VERSION 1
+// Include device_name and device_data, otherwise they restore as zeros
+#define SERIALIZE_PAYLOAD 1
+
+// Worst case for count devices
+#define SERIALIZE_MAX_BYTES(count) ( 4 + 2 + 10 + 10 + (count) * (5 + 10 + 1 + 4 + 1 + 16 + 1 + 64) )
+
+uint8_t * serialize_varint(uint8_t *out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*out++ = value;
+	return out;
+}
+
+// Returns: NULL if the varint runs past end or past 64 bits
+const uint8_t * deserialize_varint(const uint8_t *in, const uint8_t *end, uint64_t *value) {
+	int shift;
+	*value = 0;
+	for (shift = 0; in < end && shift < 64; shift += 7) {
+		*value |= (uint64_t)(*in & 0x7f) << shift;
+		if ((*in++ & 0x80) == 0) return in;
+	}
+	return NULL;
+}
+
+// Length of bytes without its trailing zeros
+int serialize_trimmed(const uint8_t *bytes, int size) {
+	while (size > 0 && bytes[size - 1] == 0) size--;
+	return size;
+}
+
+/*
+ * Write the tracked devices into buf.
+ * Returns: bytes written, or 0 if buf is too small (SERIALIZE_MAX_BYTES() always fits)
+ */
+size_t tracker_serialize(tracker_t *t, int flags, uint8_t *buf, size_t size) {
+	uint8_t scratch[SERIALIZE_MAX_BYTES(1)];
+	unsigned long long prev;
+	const device_t *dev;
+	const uint8_t *data;
+	uint32_t rf_address;
+	uint8_t *out = buf;
+	uint8_t *rec;
+	int64_t delta;
+	device_t *cur;
+	int count = 0;
+	int i, n;
+	
+	// Front to back into the sort scratch, then written back to front
+	for (cur = queue_first(t); cur != NULL && count < t->capacity; cur = queue_next(t, cur)) {
+		t->sorted[count++] = cur;
+	}
+	if (size < 4 + 2 + 10 + 10) return 0;
+	memcpy(out, SERIALIZE_MAGIC, 4);
+	out += 4;
+	*out++ = SERIALIZE_VERSION;
+	*out++ = flags;
+	out = serialize_varint(out, count);
+	prev = count > 0 ? t->sorted[count - 1]->discovery_time : 0;
+	out = serialize_varint(out, prev);
+	
+	for (i = count - 1; i >= 0; i--) {
+		dev = t->sorted[i];
+		// One record at a time into scratch, so a short buf can't be overrun
+		rec = serialize_varint(scratch, dev->adv.device_id);
+		delta = dev->discovery_time - prev;
+		rec = serialize_varint(rec, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+		prev = dev->discovery_time;
+		*rec++ = dev->adv.rssi;
+		// A metadata-only tracker has no rf_address, it restores as 0
+		rf_address = device_rf_address(t, dev);
+		*rec++ = rf_address;
+		*rec++ = rf_address >> 8;
+		*rec++ = rf_address >> 16;
+		*rec++ = rf_address >> 24;
+		if (flags & SERIALIZE_PAYLOAD) {
+			n = serialize_trimmed(device_name(t, dev), 16);
+			*rec++ = n;
+			memcpy(rec, device_name(t, dev), n);
+			rec += n;
+			// Nor device_data, it restores as zeros
+			data = device_data(t, dev);
+			n = data != NULL ? serialize_trimmed(data, 64) : 0;
+			*rec++ = n;
+			if (n > 0) memcpy(rec, data, n);
+			rec += n;
+		}
+		if (rec - scratch > buf + size - out) return 0;
+		memcpy(out, scratch, rec - scratch);
+		out += rec - scratch;
+	}
+	return out - buf;
+}
+
+/*
+ * Insert the devices from a tracker_serialize() buffer, in one pass. Meant
+ * for an empty tracker; devices it already has are left alone, and beyond
+ * capacity the oldest get evicted like always.
+ * Returns: number of devices restored, or -1 if the buffer is malformed
+ *          (the devices before the bad one stay restored)
+ */
+int tracker_deserialize(tracker_t *t, const uint8_t *buf, size_t size) {
+	const uint8_t *in = buf;
+	const uint8_t *end = buf + size;
+	pair_adv_data_t data;
+	uint64_t count, value, time;
+	int flags, restored = 0;
+	uint64_t i;
+	int n;
+	
+	if (size < 6 || memcmp(in, SERIALIZE_MAGIC, 4) != 0 || in[4] != SERIALIZE_VERSION) {
+		printf("WARNING: not a version %d device table\n", SERIALIZE_VERSION);
+		return -1;
+	}
+	flags = in[5];
+	in += 6;
+	if ((in = deserialize_varint(in, end, &count)) == NULL || (in = deserialize_varint(in, end, &time)) == NULL) {
+		printf("WARNING: truncated device table\n");
+		return -1;
+	}
+	persist_begin(t);
+	for (i = 0; i < count; i++) {
+		memset(&data, 0, sizeof(data));
+		if ((in = deserialize_varint(in, end, &value)) == NULL) break;
+		data.device_id = value;
+		if ((in = deserialize_varint(in, end, &value)) == NULL) break;
+		time += (value >> 1) ^ -(value & 1);
+		if (end - in < 5) break;
+		data.rssi = in[0];
+		data.rf_address = in[1] | in[2] << 8 | in[3] << 16 | (uint32_t)in[4] << 24;
+		in += 5;
+		if (flags & SERIALIZE_PAYLOAD) {
+			if (in == end || (n = *in++) > sizeof(data.device_name) || end - in < n) break;
+			memcpy(data.device_name, in, n);
+			in += n;
+			if (in == end || (n = *in++) > sizeof(data.device_data) || end - in < n) break;
+			memcpy(data.device_data, in, n);
+			in += n;
+		}
+		if (find_duplicate(t, &data) != NULL) continue;
+		// Evicting and reusing the slot is one change to snapshot readers, like in on_discovery_at()
+		if (t->snapshot != NULL) snapshot_batch_begin(t->snapshot);
+		if (tracker_insert(t, &data, time) != NULL) restored++;
+		if (t->snapshot != NULL) snapshot_batch_end(t->snapshot);
+	}
+	persist_end(t);
+	if (i < count) {
+		printf("WARNING: truncated device table, %d devices restored\n", restored);
+		return -1;
+	}
+	return restored;
+}
+
+/*
+ * ==========================
+ * Shared memory export
+ * ==========================
+ */
+
+/*
+ * Publishes the snapshot table into a POSIX shared memory segment, so local
+ * processes (UI, logger, pairing manager) can map it read-only and copy out
+ * the device list with snapshot_read(): no syscalls, no copies through a
+ * socket. The segment is a small header followed by the same seqlocked
+ * records the in-process snapshot uses, written by the same hook.
+ *
+ * If the writer dies mid-update a record stays odd and readers would spin on
+ * it; readers that care can check writer_pid.
+ */
+#define SHM_MAGIC "BLESHMEM"
+#define SHM_VERSION 1
+
+typedef struct shm_table {
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t record_size;
+	int32_t writer_pid;
+	_Atomic uint64_t seq;
+	snapshot_record_t records[];
+} shm_table_t;
+
+// The publishing side, owned by the tracker's process
+typedef struct shm_export {
+	char name[64];
+	shm_table_t *table;
+	size_t size;
+	snapshot_t snap;
+} shm_export_t;
+
+// A reader's read-only mapping, read through view->snap
+typedef struct shm_view {
+	const shm_table_t *table;
+	size_t size;
+	snapshot_t snap;
+} shm_view_t;
+
+/*
+ * The process publishing into the segment name, if it's still running.
+ * Returns: its pid, or 0 if there's no segment or its writer is gone
+ */
+pid_t shm_live_writer(const char *name) {
+	const shm_table_t *table;
+	struct stat st;
+	pid_t pid = 0;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(shm_table_t)) {
+		table = mmap(NULL, sizeof(shm_table_t), PROT_READ, MAP_SHARED, fd, 0);
+		if (table != MAP_FAILED) {
+			if (memcmp(table->magic, SHM_MAGIC, sizeof(table->magic)) == 0 && table->writer_pid > 0 &&
+					(kill(table->writer_pid, 0) == 0 || errno == EPERM)) {
+				pid = table->writer_pid;
+			}
+			munmap((void *)table, sizeof(shm_table_t));
+		}
+	}
+	close(fd);
+	return pid;
+}
+
+/*
+ * Create the segment name, e.g. "/proprietary_ble", sized for capacity
+ * devices, and start publishing the tracker's devices into it. A segment
+ * left behind by a writer that's gone gets replaced by a new one; readers
+ * still mapping the old one keep reading it as it was.
+ * Returns: 0 on success, -1 if another process is publishing there or the
+ *          segment can't be set up
+ */
+int shm_export_create(shm_export_t *exp, const char *name, tracker_t *t) {
+	size_t size = sizeof(shm_table_t) + t->capacity * sizeof(snapshot_record_t);
+	shm_table_t *table;
+	pid_t writer;
+	int fd;
+	
+	memset(exp, 0, sizeof(shm_export_t));
+	if (strlen(name) >= sizeof(exp->name)) {
+		printf("WARNING: shared memory name %s too long\n", name);
+		return -1;
+	}
+	if ((writer = shm_live_writer(name)) != 0) {
+		printf("WARNING: shared memory %s is in use by pid %d\n", name, (int)writer);
+		return -1;
+	}
+	// Unlinking only drops the name: old mappings keep their own segment, never a truncated one
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		printf("WARNING: can't create shared memory %s\n", name);
+		return -1;
+	}
+	// Zero filled, so readers see an empty table until it's filled
+	if (ftruncate(fd, size) != 0) {
+		printf("WARNING: can't size shared memory %s\n", name);
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		printf("WARNING: can't map shared memory %s\n", name);
+		shm_unlink(name);
+		return -1;
+	}
+	
+	snapshot_init(&exp->snap, table->records, t->capacity);
+	exp->snap.seq = &table->seq;
+	atomic_init(&table->seq, 0);
+	table->version = SHM_VERSION;
+	table->capacity = t->capacity;
+	table->record_size = sizeof(snapshot_record_t);
+	table->writer_pid = getpid();
+	// Magic last, readers check it before trusting anything else
+	atomic_thread_fence(memory_order_release);
+	memcpy(table->magic, SHM_MAGIC, sizeof(table->magic));
+	
+	strcpy(exp->name, name);
+	exp->table = table;
+	exp->size = size;
+	tracker_set_snapshot(t, &exp->snap);
+	return 0;
+}
+
+// Stop publishing and remove the segment; readers keep their mapping until they close it
+void shm_export_destroy(shm_export_t *exp, tracker_t *t) {
+	if (t->snapshot == &exp->snap) tracker_set_snapshot(t, NULL);
+	munmap(exp->table, exp->size);
+	shm_unlink(exp->name);
+	memset(exp, 0, sizeof(shm_export_t));
+}
+
+/*
+ * Map a published table read-only. Read it with snapshot_read(&view->snap, ...),
+ * which needs room for view->snap.capacity entries.
+ * Returns: 0 on success, -1 if it isn't there or isn't a table we can read
+ */
+int shm_view_open(shm_view_t *view, const char *name) {
+	const shm_table_t *table;
+	struct stat st;
+	int fd;
+	
+	memset(view, 0, sizeof(shm_view_t));
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(shm_table_t)) {
+		printf("WARNING: no device table at %s\n", name);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	table = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		printf("WARNING: can't map shared memory %s\n", name);
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (memcmp(table->magic, SHM_MAGIC, sizeof(table->magic)) != 0 ||
+			table->version != SHM_VERSION ||
+			table->record_size != sizeof(snapshot_record_t) ||
+			table->capacity > (st.st_size - sizeof(shm_table_t)) / sizeof(snapshot_record_t)) {
+		printf("WARNING: %s is not a version %d device table\n", name, SHM_VERSION);
+		munmap((void *)table, st.st_size);
+		return -1;
+	}
+	view->table = table;
+	view->size = st.st_size;
+	// Only ever read through, the records are mapped read-only
+	view->snap.seq = (_Atomic uint64_t *)&table->seq;
+	view->snap.capacity = table->capacity;
+	view->snap.records = (snapshot_record_t *)table->records;
+	return 0;
+}
+
+void shm_view_close(shm_view_t *view) {
+	munmap((void *)view->table, view->size);
+	memset(view, 0, sizeof(shm_view_t));
+}
+
+/*
+ * ==========================
+ * Query server
+ * ==========================
+ */
+
+/*
+ * Lets tooling query the tracker over a Unix domain socket without linking
+ * against it. One thread runs an epoll loop over all clients and answers
+ * from a snapshot table, so it never takes anything from on_discovery().
+ *
+ * Requests are 8 bytes: op u8 | 3 reserved | arg u32
+ * Responses are an 8 byte header, op u8 | status u8 | 2 reserved | count u32,
+ * followed by count 32 byte records (SERVER_OP_STATS: one stats record):
+ *   device_id u32 | rssi u8 | 3 reserved | discovery_time u64 | device_name 16
+ *   stats: device_count u32 | capacity u32 | updates u64 | requests u64 | clients u32 | 4 reserved
+ * All little-endian. A client gets one request answered at a time: until its
+ * response is out, the server doesn't read from it, so per-client memory
+ * stays at one request and one response however much it pipelines.
+ */
+#define SERVER_OP_TOP_N 1
+#define SERVER_OP_LOOKUP 2
+#define SERVER_OP_STATS 3
+
+#define SERVER_OK 0
+#define SERVER_NOT_FOUND 1
+#define SERVER_BAD_REQUEST 2
+
+#define SERVER_REQUEST_BYTES 8
+#define SERVER_HEADER_BYTES 8
+#define SERVER_RECORD_BYTES 32
+// Most devices one TOP_N answers with
+#define SERVER_TOP_MAX 64
+#define SERVER_RESPONSE_MAX ( SERVER_HEADER_BYTES + SERVER_TOP_MAX * SERVER_RECORD_BYTES )
+#define SERVER_MAX_CLIENTS 64
+
+typedef struct server_client {
+	int fd;
+	uint8_t in[SERVER_REQUEST_BYTES];
+	int in_len;
+	uint8_t out[SERVER_RESPONSE_MAX];
+	int out_len;
+	int out_pos;
+} server_client_t;
+
+typedef struct query_server {
+	int listen_fd;
+	int epoll_fd;
+	// Written to by query_server_stop() to wake the loop
+	int stop_fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	pthread_t thread;
+	snapshot_t *snap;
+	// Room for a full snapshot_read()
+	snapshot_entry_t *entries;
+	server_client_t clients[SERVER_MAX_CLIENTS];
+	int client_count;
+	uint64_t requests;
+} query_server_t;
+
+void server_put_u32(uint8_t *out, uint32_t value) {
+	out[0] = value;
+	out[1] = value >> 8;
+	out[2] = value >> 16;
+	out[3] = value >> 24;
+}
+
+void server_put_u64(uint8_t *out, uint64_t value) {
+	server_put_u32(out, value);
+	server_put_u32(out + 4, value >> 32);
+}
+
+uint32_t server_get_u32(const uint8_t *in) {
+	return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+uint64_t server_get_u64(const uint8_t *in) {
+	return server_get_u32(in) | (uint64_t)server_get_u32(in + 4) << 32;
+}
+
+void server_put_entry(uint8_t *out, const snapshot_entry_t *entry) {
+	memset(out, 0, SERVER_RECORD_BYTES);
+	server_put_u32(out, entry->device_id);
+	out[4] = entry->rssi;
+	server_put_u64(out + 8, entry->discovery_time);
+	memcpy(out + 16, entry->device_name, 16);
+}
+
+/*
+ * The k strongest of the entries into out, strongest first, with the same
+ * selection as tracker_top_k_by_rssi(): two passes, no sort.
+ * Returns: number written, at most k
+ */
+int server_top_k(const snapshot_entry_t *entries, int n, int k, const snapshot_entry_t **out) {
+	int count[256] = {0};
+	int cut, at_cut, i;
+	if (k <= 0) return 0;
+	for (i = 0; i < n; i++) {
+		count[entries[i].rssi]++;
+	}
+	cut = top_k_positions(count, &k, &at_cut);
+	for (i = 0; i < n; i++) {
+		if (entries[i].rssi > cut) {
+			out[count[entries[i].rssi]++] = &entries[i];
+		}
+		else if (entries[i].rssi == cut && at_cut > 0) {
+			out[count[cut]++] = &entries[i];
+			at_cut--;
+		}
+	}
+	return k;
+}
+
+// Answer the client's request into its out buffer
+void server_handle(query_server_t *srv, server_client_t *c) {
+	uint8_t op = c->in[0];
+	uint32_t arg = server_get_u32(&c->in[4]);
+	uint8_t *out = c->out;
+	const snapshot_entry_t *top[SERVER_TOP_MAX];
+	uint8_t status = SERVER_OK;
+	uint32_t count = 0;
+	int n, i;
+	
+	srv->requests++;
+	// Whole entries, but not all from one moment: under heavy traffic that could retry forever
+	n = snapshot_read(srv->snap, srv->entries, 0);
+	switch (op) {
+	case SERVER_OP_TOP_N:
+		count = server_top_k(srv->entries, n, arg < SERVER_TOP_MAX ? arg : SERVER_TOP_MAX, top);
+		for (i = 0; i < count; i++) {
+			server_put_entry(&out[SERVER_HEADER_BYTES + i * SERVER_RECORD_BYTES], top[i]);
+		}
+		break;
+	case SERVER_OP_LOOKUP:
+		status = SERVER_NOT_FOUND;
+		for (i = 0; i < n; i++) {
+			if (srv->entries[i].device_id == arg) {
+				server_put_entry(&out[SERVER_HEADER_BYTES], &srv->entries[i]);
+				status = SERVER_OK;
+				count = 1;
+				break;
+			}
+		}
+		break;
+	case SERVER_OP_STATS:
+		memset(&out[SERVER_HEADER_BYTES], 0, SERVER_RECORD_BYTES);
+		server_put_u32(&out[SERVER_HEADER_BYTES], n);
+		server_put_u32(&out[SERVER_HEADER_BYTES + 4], srv->snap->capacity);
+		// Two seqlock steps per published change
+		server_put_u64(&out[SERVER_HEADER_BYTES + 8], atomic_load_explicit(srv->snap->seq, memory_order_relaxed) / 2);
+		server_put_u64(&out[SERVER_HEADER_BYTES + 16], srv->requests);
+		server_put_u32(&out[SERVER_HEADER_BYTES + 24], srv->client_count);
+		count = 1;
+		break;
+	default:
+		status = SERVER_BAD_REQUEST;
+		break;
+	}
+	memset(out, 0, SERVER_HEADER_BYTES);
+	out[0] = op;
+	out[1] = status;
+	server_put_u32(&out[4], count);
+	c->out_len = SERVER_HEADER_BYTES + count * SERVER_RECORD_BYTES;
+	c->out_pos = 0;
+	c->in_len = 0;
+}
+
+void server_close_client(query_server_t *srv, server_client_t *c) {
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	srv->client_count--;
+}
+
+// Push out what's pending. Returns: 0 when all of it is out, 1 if the socket is full, -1 on error
+int server_flush(server_client_t *c) {
+	ssize_t n;
+	while (c->out_pos < c->out_len) {
+		n = send(c->fd, &c->out[c->out_pos], c->out_len - c->out_pos, MSG_NOSIGNAL);
+		if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		c->out_pos += n;
+	}
+	c->out_len = c->out_pos = 0;
+	return 0;
+}
+
+void server_accept(query_server_t *srv) {
+	struct epoll_event ev;
+	server_client_t *c;
+	int fd, i;
+	while ((fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = NULL;
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (srv->clients[i].fd < 0) {
+				c = &srv->clients[i];
+				break;
+			}
+		}
+		if (c == NULL) {
+			// Full up: the client sees the connection close
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->in_len = c->out_len = c->out_pos = 0;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			close(fd);
+			c->fd = -1;
+			continue;
+		}
+		srv->client_count++;
+	}
+}
+
+void server_client_event(query_server_t *srv, server_client_t *c, uint32_t events) {
+	struct epoll_event ev;
+	ssize_t n;
+	int pending;
+	
+	if (events & EPOLLOUT) {
+		pending = server_flush(c);
+	} else {
+		n = recv(c->fd, &c->in[c->in_len], SERVER_REQUEST_BYTES - c->in_len, 0);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			server_close_client(srv, c);
+			return;
+		}
+		if (n > 0) c->in_len += n;
+		if (c->in_len < SERVER_REQUEST_BYTES) return;
+		server_handle(srv, c);
+		pending = server_flush(c);
+	}
+	if (pending < 0) {
+		server_close_client(srv, c);
+		return;
+	}
+	// Either wait for room to finish the response, or go back to reading requests
+	if ((pending == 1) != ((events & EPOLLOUT) != 0)) {
+		ev.events = pending ? EPOLLOUT : EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+}
+
+void * server_loop(void *arg) {
+	query_server_t *srv = arg;
+	struct epoll_event events[16];
+	int n, i;
+	for (;;) {
+		n = epoll_wait(srv->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n < 0 && errno != EINTR) break;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &srv->stop_fd) return NULL;
+			if (events[i].data.ptr == &srv->listen_fd) {
+				server_accept(srv);
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				server_close_client(srv, events[i].data.ptr);
+			} else {
+				server_client_event(srv, events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+	printf("WARNING: query server stopped, epoll_wait failed\n");
+	return NULL;
+}
+
+/*
+ * Listen on the socket at path (replacing a stale one) and answer queries
+ * from snap on a thread of its own; snap has to be attached to the tracker.
+ * Returns: 0 on success, -1 if the socket or thread can't be set up
+ */
+int query_server_start(query_server_t *srv, const char *path, snapshot_t *snap) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event ev;
+	int i;
+	
+	memset(srv, 0, sizeof(query_server_t));
+	srv->listen_fd = srv->epoll_fd = srv->stop_fd = -1;
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) srv->clients[i].fd = -1;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("WARNING: socket path %s too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	strcpy(srv->path, path);
+	srv->snap = snap;
+	srv->entries = malloc(snap->capacity * sizeof(snapshot_entry_t));
+	srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	srv->stop_fd = eventfd(0, EFD_CLOEXEC);
+	unlink(path);
+	if (srv->entries == NULL || srv->listen_fd < 0 || srv->epoll_fd < 0 || srv->stop_fd < 0 ||
+			bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(srv->listen_fd, SERVER_MAX_CLIENTS) != 0) {
+		printf("WARNING: can't listen on %s\n", path);
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &srv->listen_fd;
+	if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev) != 0) goto fail;
+	ev.data.ptr = &srv->stop_fd;
+	if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->stop_fd, &ev) != 0) goto fail;
+	if (pthread_create(&srv->thread, NULL, server_loop, srv) != 0) goto fail;
+	return 0;
+	
+fail:
+	if (srv->listen_fd >= 0) close(srv->listen_fd);
+	if (srv->epoll_fd >= 0) close(srv->epoll_fd);
+	if (srv->stop_fd >= 0) close(srv->stop_fd);
+	free(srv->entries);
+	return -1;
+}
+
+void query_server_stop(query_server_t *srv) {
+	uint64_t one = 1;
+	int i;
+	if (write(srv->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+		printf("WARNING: can't wake the query server\n");
+	}
+	pthread_join(srv->thread, NULL);
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (srv->clients[i].fd >= 0) close(srv->clients[i].fd);
+	}
+	close(srv->listen_fd);
+	close(srv->epoll_fd);
+	close(srv->stop_fd);
+	unlink(srv->path);
+	free(srv->entries);
+}
+
+int query_connect(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Blocking request for tooling, the response lands in resp (room for SERVER_RESPONSE_MAX).
+ * Returns: response length, or -1 if the connection failed
+ */
+int query_request(int fd, uint8_t op, uint32_t arg, uint8_t *resp) {
+	uint8_t req[SERVER_REQUEST_BYTES] = { op };
+	int len = 0, want = SERVER_HEADER_BYTES;
+	ssize_t n;
+	server_put_u32(&req[4], arg);
+	if (send(fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) return -1;
+	while (len < want) {
+		n = recv(fd, &resp[len], want - len, 0);
+		if (n <= 0) return -1;
+		len += n;
+		if (len == SERVER_HEADER_BYTES) {
+			uint32_t count = server_get_u32(&resp[4]);
+			if (count > SERVER_TOP_MAX) return -1;
+			want += count * SERVER_RECORD_BYTES;
+		}
+	}
+	return len;
+}
+
+// `query <socket> top [n] | lookup <id> | stats`
+int query_main(int argc, char **argv) {
+	uint8_t resp[SERVER_RESPONSE_MAX];
+	uint32_t count, i;
+	uint8_t *rec;
+	int fd, op;
+	
+	if (argc < 4) return 1;
+	if (strcmp(argv[3], "top") == 0) op = SERVER_OP_TOP_N;
+	else if (strcmp(argv[3], "lookup") == 0 && argc > 4) op = SERVER_OP_LOOKUP;
+	else if (strcmp(argv[3], "stats") == 0) op = SERVER_OP_STATS;
+	else {
+		printf("WARNING: bad query, usage: query <socket> top [n] | lookup <id> | stats\n");
+		return 1;
+	}
+	fd = query_connect(argv[2]);
+	if (fd < 0 || query_request(fd, op, argc > 4 ? strtoul(argv[4], NULL, 10) : 10, resp) < 0) {
+		printf("WARNING: no answer from %s\n", argv[2]);
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+	close(fd);
+	count = server_get_u32(&resp[4]);
+	if (op == SERVER_OP_STATS) {
+		rec = &resp[SERVER_HEADER_BYTES];
+		printf("devices: %u capacity: %u updates: %" PRIu64 " requests: %" PRIu64 " clients: %u\n",
+				server_get_u32(rec), server_get_u32(rec + 4), server_get_u64(rec + 8), server_get_u64(rec + 16), server_get_u32(rec + 24));
+		return 0;
+	}
+	if (resp[1] != SERVER_OK) {
+		printf("not found\n");
+		return 1;
+	}
+	printf("device_id\tdevice_name\trssi\tdiscovery_time\n");
+	for (i = 0; i < count; i++) {
+		rec = &resp[SERVER_HEADER_BYTES + i * SERVER_RECORD_BYTES];
+		printf("%u\t%.16s\t%u\t%" PRIu64 "\n", server_get_u32(rec), rec + 16, rec[4], server_get_u64(rec + 8));
+	}
+	return 0;
+}
+
+/*
+ * ==========================
+ * Sharded tracker
+ * ==========================
+ */
+
+/*
+ * Splits devices across independent trackers by a hash of device_id, each
+ * with its own memory and optionally its own worker thread pinned to a core.
+ * The receive thread stamps each advertisement and hands it to the owning
+ * shard through a single producer, single consumer ring.
+ *
+ * Every shard keeps up to capacity devices, so the K most recent devices
+ * overall are always among the K most recent of their shard, as long as
+ * K <= capacity. Reports merge the shards by discovery_time to find them.
+ */
+typedef struct shard_event {
+	pair_adv_data_t adv;
+	unsigned long long timestamp;
+} shard_event_t;
+
+typedef struct shard {
+	tracker_t tracker;
+	uint8_t *mem;
+	// Held by the worker while it applies a batch, and by reports
+	pthread_mutex_t lock;
+	
+	// Ring from the receive thread (head) to the worker (tail)
+	shard_event_t *ring;
+	uint32_t ring_mask;
+	_Atomic uint32_t ring_head;
+	_Atomic uint32_t ring_tail;
+	uint32_t dropped_count;
+	
+	pthread_t thread;
+	int cpu;
+	atomic_int running;
+	// The worker blocks on wake_fd (an eventfd) once the ring is empty and
+	// sets sleeping first, so the receive thread knows to signal it
+	int wake_fd;
+	atomic_int sleeping;
+} shard_t;
+
+typedef struct sharded_tracker {
+	shard_t *shards;
+	int shard_count;
+} sharded_tracker_t;
+
+#define SHARD_BATCH 64
+
+// Independent of the in-shard bucket hash, so a shard's ids still spread over its buckets
+int shard_of(sharded_tracker_t *st, uint32_t device_id) {
+	return ((filter_hash(device_id) >> 32) * (uint32_t)st->shard_count) >> 32;
+}
+
+// Only shards that sharded_init() finished count, so this is safe after it failed too
+void sharded_destroy(sharded_tracker_t *st) {
+	int i;
+	for (i = 0; i < st->shard_count; i++) {
+		shard_t *shard = &st->shards[i];
+		tracker_destroy(&shard->tracker);
+		pthread_mutex_destroy(&shard->lock);
+		close(shard->wake_fd);
+		free(shard->mem);
+		free(shard->ring);
+	}
+	free(st->shards);
+	st->shards = NULL;
+	st->shard_count = 0;
+}
+
+/*
+ * Set up shard_count shards of capacity devices each. ring_size (a power
+ * of two) is per shard, and only matters with sharded_start().
+ * Returns: 0 on success, -1 if memory or descriptors ran out (nothing is left allocated)
+ */
+int sharded_init(sharded_tracker_t *st, int shard_count, int capacity, const eviction_policy_t *policy, uint32_t ring_size) {
+	int i;
+	st->shard_count = 0;
+	st->shards = calloc(shard_count, sizeof(shard_t));
+	if (st->shards == NULL) return -1;
+	for (i = 0; i < shard_count; i++) {
+		shard_t *shard = &st->shards[i];
+		shard->mem = malloc(TRACKER_BYTES(capacity));
+		shard->ring = malloc(ring_size * sizeof(shard_event_t));
+		shard->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (shard->mem == NULL || shard->ring == NULL || shard->wake_fd < 0) {
+			free(shard->mem);
+			free(shard->ring);
+			if (shard->wake_fd >= 0) close(shard->wake_fd);
+			// The shards before this one are complete, tear those down too
+			sharded_destroy(st);
+			return -1;
+		}
+		tracker_init(&shard->tracker, shard->mem, capacity, policy);
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->ring_mask = ring_size - 1;
+		atomic_init(&shard->ring_head, 0);
+		atomic_init(&shard->ring_tail, 0);
+		atomic_init(&shard->sleeping, 0);
+		shard->cpu = i;
+		st->shard_count = i + 1;
+	}
+	return 0;
+}
+
+// Ingest on the caller's thread, for when there are no worker threads
+void sharded_on_discovery_at(sharded_tracker_t *st, pair_adv_data_t *data, unsigned long long timestamp) {
+	shard_t *shard = &st->shards[shard_of(st, data->device_id)];
+	pthread_mutex_lock(&shard->lock);
+	on_discovery_at(&shard->tracker, data, timestamp);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+// Only a syscall when the worker is asleep, and then once until it goes back to sleep
+void shard_wake(shard_t *shard) {
+	uint64_t one = 1;
+	if (atomic_exchange(&shard->sleeping, 0)) {
+		if (write(shard->wake_fd, &one, sizeof(one)) != sizeof(one)) printf("WARNING: can't wake shard worker\n");
+	}
+}
+
+/*
+ * Hand an advertisement to its shard's worker. Only one thread may submit.
+ * Returns: 0 if queued, -1 if the shard's ring is full (counted as dropped)
+ */
+int sharded_submit(sharded_tracker_t *st, pair_adv_data_t *data, unsigned long long timestamp) {
+	shard_t *shard = &st->shards[shard_of(st, data->device_id)];
+	uint32_t head = atomic_load_explicit(&shard->ring_head, memory_order_relaxed);
+	shard_event_t *event;
+	if (head - atomic_load_explicit(&shard->ring_tail, memory_order_acquire) > shard->ring_mask) {
+		shard->dropped_count++;
+		return -1;
+	}
+	event = &shard->ring[head & shard->ring_mask];
+	event->adv = *data;
+	event->timestamp = timestamp;
+	atomic_store_explicit(&shard->ring_head, head + 1, memory_order_release);
+	// Pairs with the fence in shard_worker(): either it sees the new head or we see it sleeping
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&shard->sleeping, memory_order_relaxed)) shard_wake(shard);
+	return 0;
+}
+
+// Apply whatever is queued for the shard, a batch per lock
+int shard_drain(shard_t *shard) {
+	uint32_t tail = atomic_load_explicit(&shard->ring_tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&shard->ring_head, memory_order_acquire);
+	uint32_t end;
+	int applied = 0;
+	while (tail != head) {
+		end = head - tail > SHARD_BATCH ? tail + SHARD_BATCH : head;
+		pthread_mutex_lock(&shard->lock);
+		for (; tail != end; tail++) {
+			shard_event_t *event = &shard->ring[tail & shard->ring_mask];
+			on_discovery_at(&shard->tracker, &event->adv, event->timestamp);
+			applied++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+		atomic_store_explicit(&shard->ring_tail, tail, memory_order_release);
+	}
+	return applied;
+}
+
+void * shard_worker(void *arg) {
+	shard_t *shard = arg;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->cpu % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	
+	while (atomic_load_explicit(&shard->running, memory_order_relaxed)) {
+		if (shard_drain(shard) > 0) continue;
+		// Nothing queued: announce we're going to sleep, then look once more
+		// so a submit racing with this can't be missed
+		atomic_store_explicit(&shard->sleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&shard->ring_head, memory_order_relaxed) == atomic_load_explicit(&shard->ring_tail, memory_order_relaxed) &&
+				atomic_load_explicit(&shard->running, memory_order_relaxed)) {
+			uint64_t count;
+			if (read(shard->wake_fd, &count, sizeof(count)) != sizeof(count) && errno != EINTR) break;
+		}
+		atomic_store_explicit(&shard->sleeping, 0, memory_order_relaxed);
+	}
+	// Whatever was submitted before the stop still gets applied
+	shard_drain(shard);
+	return NULL;
+}
+
+// Start one worker thread per shard, shard i pinned to core i (modulo the core count)
+int sharded_start(sharded_tracker_t *st) {
+	int i;
+	for (i = 0; i < st->shard_count; i++) {
+		atomic_store(&st->shards[i].running, 1);
+		if (pthread_create(&st->shards[i].thread, NULL, shard_worker, &st->shards[i]) != 0) {
+			atomic_store(&st->shards[i].running, 0);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Stop the workers once they've applied everything submitted so far
+void sharded_stop(sharded_tracker_t *st) {
+	int i;
+	for (i = 0; i < st->shard_count; i++) {
+		if (atomic_exchange(&st->shards[i].running, 0)) {
+			// It might be asleep on an empty ring; a spare wakeup is harmless
+			atomic_store(&st->shards[i].sleeping, 1);
+			shard_wake(&st->shards[i]);
+			pthread_join(st->shards[i].thread, NULL);
+		}
+	}
+}
+
+/*
+ * Visit the k most recently seen devices across all shards, most recent
+ * first. Each shard's devices are put in time order, then a heap of shard
+ * cursors merges them; the shards stay locked for the duration.
+ * Returns: number of devices visited
+ */
+int sharded_visit_recent(sharded_tracker_t *st, int k, unsigned long long now, device_visitor_t visit, void *ctx) {
+	// No shards (say, after a failed sharded_init()) would mean zero length arrays below
+	if (st->shard_count <= 0) return 0;
+	int heap[st->shard_count];
+	int pos[st->shard_count];
+	int count[st->shard_count];
+	int heap_size = 0;
+	int visited = 0;
+	device_view_t view;
+	int i, top, child;
+	
+	for (i = 0; i < st->shard_count; i++) {
+		pthread_mutex_lock(&st->shards[i].lock);
+	}
+	// Max-heap of shards, keyed on the discovery_time of each shard's next device
+	#define SHARD_HEAD_TIME(s) ( st->shards[s].tracker.sorted[pos[s]]->discovery_time )
+	for (i = 0; i < st->shard_count; i++) {
+		pos[i] = 0;
+		count[i] = tracker_sort_by_time(&st->shards[i].tracker);
+		if (count[i] == 0) continue;
+		// Sift up
+		child = heap_size++;
+		while (child > 0 && SHARD_HEAD_TIME(heap[(child - 1) / 2]) < SHARD_HEAD_TIME(i)) {
+			heap[child] = heap[(child - 1) / 2];
+			child = (child - 1) / 2;
+		}
+		heap[child] = i;
+	}
+	while (heap_size > 0 && visited < k) {
+		top = heap[0];
+		device_view_init(&view, &st->shards[top].tracker, st->shards[top].tracker.sorted[pos[top]], now);
+		visited++;
+		if (visit(&view, ctx)) break;
+		
+		// Advance the top shard, or drop it from the heap once it runs out
+		if (++pos[top] == count[top]) {
+			top = heap[--heap_size];
+		}
+		// Sift down
+		for (i = 0; (child = 2 * i + 1) < heap_size; i = child) {
+			if (child + 1 < heap_size && SHARD_HEAD_TIME(heap[child + 1]) > SHARD_HEAD_TIME(heap[child])) child++;
+			if (SHARD_HEAD_TIME(heap[child]) <= SHARD_HEAD_TIME(top)) break;
+			heap[i] = heap[child];
+		}
+		if (heap_size > 0) heap[i] = top;
+	}
+	#undef SHARD_HEAD_TIME
+	for (i = 0; i < st->shard_count; i++) {
+		pthread_mutex_unlock(&st->shards[i].lock);
+	}
+	return visited;
+}
+
+/*
+ * ==========================
+ * Warm restart
+ * ==========================
+ */
+
+// Policies a persistent tracker can use. The log policy isn't one, its log is caller memory.
+const eviction_policy_t *persist_policies[] = { &policy_lru, &policy_fifo, &policy_lfu, &policy_clock };
+
+// The file also carries the links of expiry, the RSSI index and change tracking, so those persist too
+#define PERSIST_LINK_BYTES(capacity) ( (capacity) * (2 * sizeof(slot_link_t) + sizeof(change_link_t)) )
+#define PERSIST_BYTES(capacity) ( TRACKER_ALIGN(sizeof(persist_header_t)) + TRACKER_ALIGN(sizeof(tracker_t)) + \
+		TRACKER_ALIGN(TRACKER_BYTES(capacity)) + PERSIST_LINK_BYTES(capacity) )
+
+int persist_policy_id(const eviction_policy_t *policy) {
+	int i;
+	for (i = 0; i < sizeof(persist_policies) / sizeof(persist_policies[0]); i++) {
+		if (persist_policies[i] == policy) return i;
+	}
+	return -1;
+}
+
+#if USE_FIXED_POOL
+
+#define PERSIST_REBASE(p, delta) do { if ((p) != NULL) (p) = (void *)((uint8_t *)(p) + (delta)); } while (0)
+
+/*
+ * The mapping moved by delta bytes since the state was written: fix up every
+ * pointer into it. Devices link by slot, so only the tracker's own pointers
+ * and the pool's free list need it.
+ */
+void persist_relocate(tracker_t *t, ptrdiff_t delta) {
+	PERSIST_REBASE(t->pool, delta);
+	PERSIST_REBASE(t->sorted, delta);
+	PERSIST_REBASE(t->id_buckets, delta);
+	PERSIST_REBASE(t->head, delta);
+	PERSIST_REBASE(t->tail, delta);
+	PERSIST_REBASE(t->timer_links, delta);
+	PERSIST_REBASE(t->rssi_links, delta);
+	PERSIST_REBASE(t->change_links, delta);
+	pool_rebase(t->pool, delta);
+}
+
+#endif
+
+/*
+ * Open the tracker kept in the file at path, creating it if needed. A
+ * valid state from a previous run is reattached as it is: the header
+ * gets checked, and if the same address is free the mapping goes right
+ * back there so no pointer needs touching. Otherwise the state is
+ * relocated. Anything that doesn't check out (other capacity, policy or
+ * build, or a crash mid-update) starts empty.
+ * Settings like max age, rate limit and indexes persist along with the
+ * devices; a filter, snapshot or recorder has to be attached again.
+ * Returns: the tracker, or NULL if the file can't be used.
+ *          restored is set when devices came back from the file.
+ */
+tracker_t * tracker_persist_open(const char *path, int capacity, const eviction_policy_t *policy, int *restored) {
+#if USE_FIXED_POOL
+	size_t size = PERSIST_BYTES(capacity);
+	int policy_id = persist_policy_id(policy);
+	persist_header_t saved;
+	persist_header_t *header;
+	uint8_t *map = MAP_FAILED;
+	struct stat st;
+	tracker_t *t;
+	int fd, warm = 0;
+	
+	if (restored != NULL) *restored = 0;
+	if (policy_id < 0) {
+		printf("WARNING: policy %s can't be persisted\n", policy->name);
+		return NULL;
+	}
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		printf("WARNING: can't open tracker state %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size == size && pread(fd, &saved, sizeof(saved), 0) == sizeof(saved) &&
+			memcmp(saved.magic, PERSIST_MAGIC, sizeof(saved.magic)) == 0 &&
+			saved.version == PERSIST_VERSION &&
+			saved.layout == PERSIST_LAYOUT &&
+			saved.capacity == capacity &&
+			saved.policy == policy_id &&
+			saved.size == size) {
+		if (saved.in_update) {
+			printf("WARNING: tracker state %s was left mid-update, starting empty\n", path);
+		} else {
+			warm = 1;
+			map = mmap((void *)(uintptr_t)saved.base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+		}
+	}
+	if (!warm && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+		printf("WARNING: can't size tracker state %s\n", path);
+		close(fd);
+		return NULL;
+	}
+	if (map == MAP_FAILED) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("WARNING: can't map tracker state %s\n", path);
+		return NULL;
+	}
+	
+	header = (persist_header_t *)map;
+	t = (tracker_t *)&map[ TRACKER_ALIGN(sizeof(persist_header_t)) ];
+	if (warm) {
+		// Kernels before 4.17 take MAP_FIXED_NOREPLACE as a hint, so check where it landed
+		if ((uintptr_t)map != header->base) {
+			persist_relocate(t, map - (uint8_t *)(uintptr_t)header->base);
+			header->base = (uintptr_t)map;
+		}
+		t->policy = policy;
+		t->filter = NULL;
+		t->snapshot = NULL;
+		t->recorder = NULL;
+		// Their memory was the caller's too, tracker_use_rf_index(),
+		// tracker_use_name_index() and tracker_use_report_columns() rebuild them
+		t->rf_buckets = NULL;
+		t->rf_next = NULL;
+		t->name_keys = NULL;
+		t->name_count = 0;
+		t->col_time = NULL;
+		t->col_live = NULL;
+		t->col_rssi = NULL;
+	} else {
+		uint8_t *links = &map[ TRACKER_ALIGN(sizeof(persist_header_t)) + TRACKER_ALIGN(sizeof(tracker_t)) + TRACKER_ALIGN(TRACKER_BYTES(capacity)) ];
+		tracker_init(t, &map[ TRACKER_ALIGN(sizeof(persist_header_t)) + TRACKER_ALIGN(sizeof(tracker_t)) ], capacity, policy);
+		// change_link_t first, it's the one that needs 8 byte alignment
+		t->change_links = (change_link_t *)links;
+		t->timer_links = (slot_link_t *)&links[capacity * sizeof(change_link_t)];
+		t->rssi_links = &t->timer_links[capacity];
+		header->version = PERSIST_VERSION;
+		header->layout = PERSIST_LAYOUT;
+		header->capacity = capacity;
+		header->policy = policy_id;
+		header->base = (uintptr_t)map;
+		header->size = size;
+		header->in_update = 0;
+		// Magic last, so a half written header never validates
+		atomic_signal_fence(memory_order_seq_cst);
+		memcpy(header->magic, PERSIST_MAGIC, sizeof(header->magic));
+	}
+	t->persist = header;
+	if (restored != NULL) *restored = warm;
+	return t;
+#else
+	printf("WARNING: persistent trackers need USE_FIXED_POOL\n");
+	return NULL;
+#endif
+}
+
+// Detach from the file, leaving the devices in it for the next tracker_persist_open()
+void tracker_persist_close(tracker_t *t) {
+	persist_header_t *header = t->persist;
+	munmap(header, header->size);
+}
+
+/*
+ * ==========================
+ * Workload generator
+ * ==========================
+ */
+
+/*
+ * Deterministic advertisement streams for tests and benchmarks, stamped
+ * with a virtual clock instead of systime_ms_get() so millions of events
+ * replay in a second. Everything but rssi is derived from device_id, so a
+ * device looks the same each time it shows up, like a real one.
+ *
+ * WORKLOAD_STEADY:    an office building, 20 devices advertising once a second each
+ * WORKLOAD_TRADESHOW: a few long-lived devices (ids 1..8) among hundreds of
+ *                     visitors, with the crowd slowly drifting by
+ * WORKLOAD_ZIPF:      a fixed population where a few devices do most of the talking
+ * WORKLOAD_BURSTY:    a quiet background, now and then one misbehaving
+ *                     device floods the air with back to back advertisements
+ */
+#define WORKLOAD_STEADY 0
+#define WORKLOAD_TRADESHOW 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_BURSTY 3
+
+#define WORKLOAD_LONG_LIVED 8
+
+typedef struct workload {
+	int kind;
+	uint32_t seed;
+	unsigned long long now;
+	uint64_t events;
+	
+	// Devices in play (the crowd for the trade show)
+	uint32_t population;
+	// Trade show: lowest crowd id, bumped every churn_every events
+	uint32_t crowd_base;
+	uint32_t churn_every;
+	
+	// Zipf: the constants from Gray et al., "Quickly generating billion-record
+	// synthetic databases" (as used by YCSB), theta < 1
+	double theta;
+	double zeta_n;
+	double alpha;
+	double eta;
+	
+	// Bursty: advertisements left in the current flood, and who's flooding
+	uint32_t burst_left;
+	uint32_t burst_id;
+} workload_t;
+
+uint32_t workload_rand(workload_t *w) {
+	// xorshift32
+	uint32_t x = w->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	w->seed = x;
+	return x;
+}
+
+// Zipf population size and skew need to be set before this, it's O(population)
+void workload_zipf_setup(workload_t *w) {
+	double zeta_2 = 1.0 + pow(0.5, w->theta);
+	uint32_t i;
+	w->zeta_n = 0;
+	for (i = 1; i <= w->population; i++) {
+		w->zeta_n += 1.0 / pow(i, w->theta);
+	}
+	w->alpha = 1.0 / (1.0 - w->theta);
+	w->eta = (1.0 - pow(2.0 / w->population, 1.0 - w->theta)) / (1.0 - zeta_2 / w->zeta_n);
+}
+
+// A seed of 0 gets replaced, xorshift would be stuck at 0
+void workload_init(workload_t *w, int kind, uint32_t seed, unsigned long long start_ms) {
+	memset(w, 0, sizeof(workload_t));
+	w->kind = kind;
+	w->seed = seed ? seed : 2020;
+	w->now = start_ms;
+	switch (kind) {
+	case WORKLOAD_STEADY:
+		w->population = 20;
+		break;
+	case WORKLOAD_TRADESHOW:
+		w->population = 300;
+		w->crowd_base = 1000;
+		w->churn_every = 16;
+		break;
+	case WORKLOAD_ZIPF:
+		w->population = 1000;
+		w->theta = 0.99;
+		workload_zipf_setup(w);
+		break;
+	case WORKLOAD_BURSTY:
+		w->population = 50;
+		break;
+	}
+}
+
+uint32_t workload_zipf_id(workload_t *w) {
+	double u = workload_rand(w) / 4294967296.0;
+	double uz = u * w->zeta_n;
+	uint32_t rank;
+	if (uz < 1.0) return 1;
+	if (uz < 1.0 + pow(0.5, w->theta)) return 2;
+	rank = 1 + (uint32_t)(w->population * pow(w->eta * u - w->eta + 1.0, w->alpha));
+	return rank > w->population ? w->population : rank;
+}
+
+/*
+ * The next advertisement into out, everything but the payload filled in.
+ * Returns: its virtual timestamp in ms
+ */
+unsigned long long workload_next(workload_t *w, pair_adv_data_t *out) {
+	uint32_t r = workload_rand(w);
+	uint32_t id = 0;
+	uint64_t h;
+	char *name;
+	
+	switch (w->kind) {
+	case WORKLOAD_STEADY:
+		// Round robin, each device once a second with a little jitter
+		id = 1 + w->events % w->population;
+		w->now += 1000 / w->population - 5 + r % 11;
+		break;
+	case WORKLOAD_TRADESHOW:
+		if (r % 4 == 0) {
+			id = 1 + (r >> 8) % WORKLOAD_LONG_LIVED;
+		} else {
+			id = w->crowd_base + (r >> 8) % w->population;
+		}
+		if (w->events % w->churn_every == w->churn_every - 1) w->crowd_base++;
+		// Hundreds of devices, a couple of advertisements each per second
+		w->now += r % 4;
+		break;
+	case WORKLOAD_ZIPF:
+		id = workload_zipf_id(w);
+		w->now += r % 3;
+		break;
+	case WORKLOAD_BURSTY:
+		if (w->burst_left == 0 && r % 512 == 0) {
+			w->burst_id = 1 + (r >> 9) % w->population;
+			w->burst_left = 100 + (r >> 16) % 400;
+		}
+		if (w->burst_left > 0) {
+			w->burst_left--;
+			id = w->burst_id;
+			w->now += (r >> 8) % 2;
+		} else {
+			id = 1 + (r >> 8) % w->population;
+			w->now += 10 + (r >> 8) % 30;
+		}
+		break;
+	}
+	w->events++;
+	
+	h = filter_hash(id);
+	out->device_id = id;
+	out->rf_address = (uint32_t)h;
+	// Each device sits at its own distance, give or take a bit of fading
+	out->rssi = 40 + (h >> 32) % 160 + (r >> 24) % 9 - 4;
+	name = (char *)out->device_name;
+	memset(name, 0, sizeof(out->device_name));
+	memcpy(name, "ble_", 4);
+	*render_u64(name + 4, id) = 0;
+	return w->now;
+}
+
+/*
+ * ==========================
+ * Trace replay
+ * ==========================
+ */
+
+// Feed the tracker as fast as it goes, with the recorded timestamps
+#define TRACE_SPEED_MAX 0
+// Wait out the recorded gaps, with timestamps moved to the current time
+#define TRACE_SPEED_RECORDED 1
+
+typedef struct trace_replay {
+	uint8_t *map;
+	size_t size;
+	const trace_header_t *header;
+	const trace_record_t *records;
+	const trace_payload_t *payloads;
+} trace_replay_t;
+
+/*
+ * Map a trace file and check that it's one we can read.
+ * Returns: 0 on success, -1 if it can't be opened or isn't a valid trace
+ */
+int trace_replay_open(trace_replay_t *r, const char *path) {
+	const trace_header_t *h;
+	struct stat st;
+	int fd;
+	memset(r, 0, sizeof(trace_replay_t));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("WARNING: can't open trace %s\n", path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(trace_header_t)) {
+		printf("WARNING: %s is too short for a trace\n", path);
+		close(fd);
+		return -1;
+	}
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		printf("WARNING: can't map trace %s\n", path);
+		r->map = NULL;
+		return -1;
+	}
+	h = (const trace_header_t *)r->map;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version != TRACE_VERSION ||
+			h->record_size != sizeof(trace_record_t) ||
+			h->payload_size != sizeof(trace_payload_t) ||
+			h->record_count > (r->size - sizeof(trace_header_t)) / sizeof(trace_record_t) ||
+			h->payload_offset != sizeof(trace_header_t) + h->record_count * sizeof(trace_record_t) ||
+			h->payload_count > (r->size - h->payload_offset) / sizeof(trace_payload_t)) {
+		printf("WARNING: %s is not a valid version %d trace\n", path, TRACE_VERSION);
+		munmap(r->map, r->size);
+		r->map = NULL;
+		return -1;
+	}
+	r->header = h;
+	r->records = (const trace_record_t *)(r->map + sizeof(trace_header_t));
+	r->payloads = (const trace_payload_t *)(r->map + h->payload_offset);
+	madvise(r->map, r->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+void trace_replay_close(trace_replay_t *r) {
+	if (r->map != NULL) munmap(r->map, r->size);
+	memset(r, 0, sizeof(trace_replay_t));
+}
+
+/*
+ * Rebuild advertisement i of the trace into out, and its recorded timestamp.
+ * Returns: 0 on success, -1 if its payload index is out of range
+ */
+int trace_replay_get(trace_replay_t *r, uint64_t i, pair_adv_data_t *out, unsigned long long *timestamp) {
+	const trace_record_t *record = &r->records[i];
+	const trace_payload_t *payload;
+	if (record->payload >= r->header->payload_count) return -1;
+	payload = &r->payloads[record->payload];
+	out->device_id = record->device_id;
+	out->rf_address = record->rf_address;
+	out->rssi = record->rssi;
+	memcpy(out->device_name, payload->device_name, sizeof(out->device_name));
+	memcpy(out->device_data, payload->device_data, sizeof(out->device_data));
+	*timestamp = record->timestamp;
+	return 0;
+}
+
+/*
+ * Feed the whole trace to the tracker at TRACE_SPEED_MAX or TRACE_SPEED_RECORDED.
+ * Returns: number of advertisements replayed
+ */
+uint64_t trace_replay(trace_replay_t *r, tracker_t *t, int speed) {
+	pair_adv_data_t data;
+	unsigned long long first = 0, base = 0, timestamp, due_ms;
+	struct timespec start, now;
+	uint64_t i, replayed = 0;
+	long long wait_us;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	base = systime_ms_get();
+	for (i = 0; i < r->header->record_count; i++) {
+		if (trace_replay_get(r, i, &data, &timestamp) != 0) {
+			printf("WARNING: trace record %" PRIu64 " has a bad payload index\n", i);
+			continue;
+		}
+		if (replayed == 0) first = timestamp;
+		if (speed == TRACE_SPEED_RECORDED) {
+			due_ms = timestamp > first ? timestamp - first : 0;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_us = (long long)due_ms * 1000 - ((now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000);
+			if (wait_us > 0) usleep(wait_us);
+			timestamp = base + due_ms;
+		}
+		on_discovery_at(t, &data, timestamp);
+		replayed++;
+	}
+	return replayed;
+}
+
+// `record <file> [workload] [events]`: there's no radio here, so capture a synthetic workload
+int trace_main_record(const char *path, int kind, int events) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	pair_adv_data_t data = {0};
+	trace_recorder_t rec;
+	workload_t w;
+	tracker_t t;
+	int i;
+	if (trace_recorder_open(&rec, path) != 0) return 1;
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	tracker_set_recorder(&t, &rec);
+	workload_init(&w, kind, 2020, systime_ms_get());
+	for (i = 0; i < events; i++) {
+		unsigned long long timestamp = workload_next(&w, &data);
+		on_discovery_at(&t, &data, timestamp);
+	}
+	tracker_destroy(&t);
+	printf("recorded %d advertisements from %u devices to %s\n", events, rec.header.payload_count, path);
+	return trace_recorder_close(&rec) == 0 ? 0 : 1;
+}
+
+// `replay <file> [recorded]`: replay into a default tracker and print what it ends up with
+int trace_main_replay(const char *path, int speed) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	char buf[RENDER_ROW_MAX * (TRACKER_CAPACITY + 1)];
+	pair_adv_data_t last;
+	trace_replay_t replay;
+	struct timespec start, end;
+	uint64_t replayed;
+	double seconds;
+	tracker_t t;
+	if (trace_replay_open(&replay, path) != 0) return 1;
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	replayed = trace_replay(&replay, &t, speed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("replayed %" PRIu64 " advertisements from %u devices in %.3f s (%.0f/s)\n",
+			replayed, replay.header->payload_count, seconds, replayed / seconds);
+	if (replayed > 0) {
+		// Ages as of the end of the trace, which is only now at recorded speed
+		unsigned long long now = systime_ms_get();
+		if (speed != TRACE_SPEED_RECORDED) trace_replay_get(&replay, replay.header->record_count - 1, &last, &now);
+		fflush(stdout);
+		if (write(STDOUT_FILENO, buf, tracker_render_table(&t, REPORT_BY_RSSI, now, buf, sizeof(buf))) < 0) {
+			printf("WARNING: can't write report\n");
+		}
+	}
+	tracker_destroy(&t);
+	trace_replay_close(&replay);
+	return 0;
+}
+
+// `serve <socket> <file>`: replay a trace at recorded speed while answering queries, to try out tooling
+int trace_main_serve(const char *socket_path, const char *path) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	snapshot_record_t records[TRACKER_CAPACITY];
+	trace_replay_t replay;
+	query_server_t srv;
+	snapshot_t snap;
+	tracker_t t;
+	if (trace_replay_open(&replay, path) != 0) return 1;
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	snapshot_init(&snap, records, TRACKER_CAPACITY);
+	tracker_set_snapshot(&t, &snap);
+	if (query_server_start(&srv, socket_path, &snap) != 0) {
+		trace_replay_close(&replay);
+		return 1;
+	}
+	printf("serving %s, replaying %" PRIu64 " advertisements\n", socket_path, replay.header->record_count);
+	fflush(stdout);
+	trace_replay(&replay, &t, TRACE_SPEED_RECORDED);
+	query_server_stop(&srv);
+	tracker_destroy(&t);
+	trace_replay_close(&replay);
+	return 0;
+}
+
+/*
+ * ==========================
+ * Miss ratio curve
+ * ==========================
+ */
+
+/*
+ * Capacity planning from a trace: one pass gives the LRU miss count at every
+ * capacity at once (Mattson et al.'s stack algorithm). An advertisement's
+ * stack distance is the number of distinct devices seen since that device's
+ * previous advertisement, itself included; an LRU tracker of capacity c still
+ * has the device iff the distance is <= c. Each previous advertisement keeps
+ * a mark at its trace position in a Fenwick tree, so a distance is a range
+ * count, O(log n).
+ *
+ * A device that comes back within active_gap_ms was still around, so missing
+ * it means some on_discovery() evicted a device that was still active. That's
+ * the number to size against. Models a plain LRU tracker, no filter, rate
+ * limit or expiry.
+ */
+typedef struct mrc_last {
+	uint32_t device_id;
+	// Trace position + 1 of the device's latest advertisement, 0 for an empty slot
+	uint32_t pos;
+	unsigned long long timestamp;
+} mrc_last_t;
+
+typedef struct mrc {
+	unsigned long long active_gap_ms;
+	uint32_t length;
+	uint32_t accesses;
+	// Fenwick tree over trace positions, 1 based
+	uint32_t *marks;
+	// device_id -> latest advertisement, open addressing
+	mrc_last_t *last;
+	uint32_t last_mask;
+	uint32_t devices;
+	
+	// First sightings, which miss at any capacity
+	uint64_t cold;
+	uint64_t active_reuses;
+	// Reuses by stack distance; after mrc_finish(), misses at each capacity instead
+	uint64_t *misses;
+	uint64_t *active_evictions;
+} mrc_t;
+
+/*
+ * Set up for a trace of up to length advertisements, active_gap_ms as above.
+ * Returns: 0 on success, -1 if memory ran out
+ */
+int mrc_init(mrc_t *m, uint32_t length, unsigned long long active_gap_ms) {
+	memset(m, 0, sizeof(mrc_t));
+	m->active_gap_ms = active_gap_ms;
+	m->length = length;
+	m->marks = calloc(length + 1, sizeof(uint32_t));
+	m->last_mask = 1023;
+	m->last = calloc(m->last_mask + 1, sizeof(mrc_last_t));
+	// Distances never exceed the number of devices, grown along with it
+	m->misses = calloc(m->last_mask + 2, sizeof(uint64_t));
+	m->active_evictions = calloc(m->last_mask + 2, sizeof(uint64_t));
+	if (m->marks == NULL || m->last == NULL || m->misses == NULL || m->active_evictions == NULL) return -1;
+	return 0;
+}
+
+void mrc_destroy(mrc_t *m) {
+	free(m->marks);
+	free(m->last);
+	free(m->misses);
+	free(m->active_evictions);
+	memset(m, 0, sizeof(mrc_t));
+}
+
+void mrc_mark(mrc_t *m, uint32_t pos, int delta) {
+	for (; pos <= m->length; pos += pos & -pos) m->marks[pos] += delta;
+}
+
+uint32_t mrc_count(mrc_t *m, uint32_t pos) {
+	uint32_t count = 0;
+	for (; pos > 0; pos -= pos & -pos) count += m->marks[pos];
+	return count;
+}
+
+mrc_last_t * mrc_find(mrc_t *m, uint32_t device_id) {
+	uint32_t i = (filter_hash(device_id) >> 32) & m->last_mask;
+	while (m->last[i].pos != 0 && m->last[i].device_id != device_id) {
+		i = (i + 1) & m->last_mask;
+	}
+	return &m->last[i];
+}
+
+// Double the device table, and the histograms with it
+int mrc_grow(mrc_t *m) {
+	mrc_last_t *old = m->last;
+	uint32_t old_size = m->last_mask + 1;
+	uint64_t *misses = realloc(m->misses, (2 * old_size + 1) * sizeof(uint64_t));
+	uint64_t *active = misses != NULL ? realloc(m->active_evictions, (2 * old_size + 1) * sizeof(uint64_t)) : NULL;
+	uint32_t i;
+	if (misses != NULL) m->misses = misses;
+	if (active != NULL) m->active_evictions = active;
+	m->last = calloc(2 * old_size, sizeof(mrc_last_t));
+	if (misses == NULL || active == NULL || m->last == NULL) {
+		free(m->last);
+		m->last = old;
+		return -1;
+	}
+	memset(&m->misses[old_size + 1], 0, old_size * sizeof(uint64_t));
+	memset(&m->active_evictions[old_size + 1], 0, old_size * sizeof(uint64_t));
+	m->last_mask = 2 * old_size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].pos != 0) *mrc_find(m, old[i].device_id) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * Account for the next advertisement of the trace.
+ * Returns: 0, or -1 past length or out of memory
+ */
+int mrc_access(mrc_t *m, uint32_t device_id, unsigned long long timestamp) {
+	uint32_t pos = m->accesses + 1;
+	uint32_t distance;
+	mrc_last_t *last;
+	if (pos > m->length) return -1;
+	if (2 * (m->devices + 1) > m->last_mask + 1 && mrc_grow(m) != 0) return -1;
+	
+	last = mrc_find(m, device_id);
+	if (last->pos == 0) {
+		m->cold++;
+		m->devices++;
+		last->device_id = device_id;
+	} else {
+		distance = mrc_count(m, pos - 1) - mrc_count(m, last->pos) + 1;
+		m->misses[distance]++;
+		if (timestamp - last->timestamp <= m->active_gap_ms) {
+			m->active_reuses++;
+			m->active_evictions[distance]++;
+		}
+		mrc_mark(m, last->pos, -1);
+	}
+	mrc_mark(m, pos, 1);
+	last->pos = pos;
+	last->timestamp = timestamp;
+	m->accesses++;
+	return 0;
+}
+
+// Turn the distance histograms into counts per capacity, once the whole trace is in
+void mrc_finish(mrc_t *m) {
+	uint64_t misses = m->cold;
+	uint64_t active = 0;
+	uint32_t c;
+	// At capacity c, everything further than c misses
+	for (c = m->devices; ; c--) {
+		uint64_t at_c = m->misses[c];
+		uint64_t active_at_c = m->active_evictions[c];
+		m->misses[c] = misses;
+		m->active_evictions[c] = active;
+		if (c == 0) break;
+		misses += at_c;
+		active += active_at_c;
+	}
+}
+
+uint64_t mrc_misses(mrc_t *m, uint32_t capacity) {
+	return m->misses[capacity < m->devices ? capacity : m->devices];
+}
+
+uint64_t mrc_active_evictions(mrc_t *m, uint32_t capacity) {
+	return m->active_evictions[capacity < m->devices ? capacity : m->devices];
+}
+
+/*
+ * Smallest capacity that keeps at least target (0..1) of the active devices
+ * when they come back.
+ */
+uint32_t mrc_capacity_for(mrc_t *m, double target) {
+	uint32_t lo = 1, hi = m->devices > 0 ? m->devices : 1, mid;
+	// Active evictions only go down as capacity goes up
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mrc_active_evictions(m, mid) <= (1.0 - target) * m->active_reuses) hi = mid;
+		else lo = mid + 1;
+	}
+	return lo;
+}
+
+// `mrc <file> [active_gap_ms] [target]`: the curve at a spread of capacities, and the pick for the target
+int mrc_main(const char *path, unsigned long long active_gap_ms, double target) {
+	trace_replay_t replay;
+	uint64_t i;
+	uint32_t c, step;
+	mrc_t m;
+	if (trace_replay_open(&replay, path) != 0) return 1;
+	if (replay.header->record_count > UINT32_MAX - 1 || mrc_init(&m, replay.header->record_count, active_gap_ms) != 0) {
+		printf("WARNING: trace too large to analyze\n");
+		trace_replay_close(&replay);
+		return 1;
+	}
+	for (i = 0; i < replay.header->record_count; i++) {
+		if (mrc_access(&m, replay.records[i].device_id, replay.records[i].timestamp) != 0) {
+			printf("WARNING: out of memory at advertisement %" PRIu64 "\n", i);
+			break;
+		}
+	}
+	trace_replay_close(&replay);
+	mrc_finish(&m);
+	
+	printf("advertisements: %u devices: %u active reuses (gap <= %llu ms): %" PRIu64 "\n",
+			m.accesses, m.devices, active_gap_ms, m.active_reuses);
+	printf("capacity\tmiss_ratio\tactive_evictions\tactive_retention\n");
+	for (c = 1, step = 1; c <= m.devices; c += step) {
+		printf("%u\t%.4f\t%" PRIu64 "\t%.4f\n", c,
+				(double)mrc_misses(&m, c) / m.accesses,
+				mrc_active_evictions(&m, c),
+				m.active_reuses ? 1.0 - (double)mrc_active_evictions(&m, c) / m.active_reuses : 1.0);
+		// 1..16 one by one, then 8 steps per doubling
+		if (c >= 16 && (c & (c - 1)) == 0) step = c / 8;
+	}
+	c = mrc_capacity_for(&m, target);
+	printf("smallest capacity for %.2f%% active retention: %u (%" PRIu64 " active evictions)\n",
+			100.0 * target, c, mrc_active_evictions(&m, c));
+	mrc_destroy(&m);
+	return 0;
+}
+
+/*
+ * ==========================
+ * Tests
+ * ==========================
+ */
+
+// The tracker shared by the tests below
+tracker_t tracker;
+
+int test_failures = 0;
+#define TEST_CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+void test_time(void) {
+	unsigned long long timestamp;
+	timestamp = systime_ms_get();
+	printf("======== test_time ========\n");
+	printf("Timestamp: %llu\n", timestamp);
+}
+
+
+#if USE_FIXED_POOL
+#define TEST_POOL_SIZE 4
+void test_pool(void) {
+	int i;
+	device_t *pointers[TEST_POOL_SIZE];
+	
+	printf("======== test_pool ========\n");
+	
+	pool_init(device_pool, sizeof(device_t), TEST_POOL_SIZE);
+	pool_print(device_pool);
+	
+	for (i = 0; i < TEST_POOL_SIZE; i++) {
+		pointers[i] = pool_alloc(device_pool, sizeof(device_t));
+	}
+	pool_print(device_pool);
+	for (i = 0; i < TEST_POOL_SIZE; i++) {
+		pool_free(device_pool, pointers[i]);
+	}
+	pool_print(device_pool);
+	pool_destroy(device_pool);
+}
+#else
+void test_pool(void) {
+}
+#endif
+
+// Test that the queue can fill up and pop old devices off the end
+void test_queue_fill(void) {
+	int i;
+	pair_adv_data_t cur = {0};
+	uint8_t rssi = 1;
+	printf("======== test_queue_fill ========\n");
+	for (i = 1; i <= 64; i++) {
+		cur.rssi = rssi;
+		cur.device_id = i;
+		// unimportant info for this test run
+		/*
+		sprintf((char *)cur.device_name, "proprietary_%02d", i);
+		sprintf((char *)cur.device_data, "data_%02d", i);
+		cur.rf_address = i;
+		*/
+		
+		on_discovery(&tracker, &cur);
+		// wait a bit to get a new timestamp
+		usleep(5 *1000);
+		// scramble RSSI 
+		rssi += 21;
+	}
+	print_queue_by_time(&tracker);
+	queue_clear(&tracker);
+}
+
+// Reinstert the same 5 devices over and over again
+void test_duplicates(void) {
+	int i, j;
+	pair_adv_data_t cur = {0};
+	uint8_t rssi = 1;
+	printf("======== test_duplicates ========\n");
+	for (j = 1; j <= 3; j++) {
+		printf("Round %d\n", j);
+		for (i = 1; i <= 5; i++) {
+			cur.rssi = rssi;
+			cur.device_id = i;			
+			on_discovery(&tracker, &cur);
+			// wait a bit to get a new timestamp
+			usleep(5 *1000);
+			
+			// scramble RSSI 
+			rssi += 21;
+		}
+		print_queue_by_time(&tracker);
+	}
+	queue_clear(&tracker);
+}
+
+// Make sure recurring devices don't drown out all others
+void test_duplicates_and_uniques(void) {
+	int i, j;
+	int udc = 6; // unique device counter
+	pair_adv_data_t cur = {0};
+	uint8_t rssi = 1;
+	printf("======== test_duplicates_and_uniques ========\n");
+	
+	// unique devices
+	for (i = 1; i <= 32; i++) {
+		cur.rssi = rssi;
+		cur.device_id = udc++;			
+		on_discovery(&tracker, &cur);
+		// wait a bit to get a new timestamp
+		usleep(5 *1000);
+		
+		// scramble RSSI 
+		rssi += 21;
+	}
+	// recurring devices; they should not push out old devices
+	for (j = 1; j <= 7; j++) {
+		for (i = 1; i <= 5; i++) {
+			cur.rssi = rssi;
+			cur.device_id = i;			
+			on_discovery(&tracker, &cur);
+			// wait a bit to get a new timestamp
+			usleep(5 *1000);
+			
+			// scramble RSSI 
+			rssi += 21;
+		}
+	}
+	print_queue_by_time(&tracker);
+	print_queue_by_rssi(&tracker);
+	queue_clear(&tracker);
+}
+
+// Each policy gets the same script; only the device it evicts for device 5 differs
+void test_eviction_policies(void) {
+	const eviction_policy_t *policies[] = { &policy_lru, &policy_fifo, &policy_lfu, &policy_clock };
+	uint32_t expected_victim[] = { 4, 1, 2, 1 };
+	uint32_t script[] = { 1, 2, 3, 4, 4, 3, 2, 1, 1, 5 };
+	uint8_t pool[TRACKER_BYTES(4)];
+	pair_adv_data_t cur = {0};
+	tracker_t t;
+	int i, p;
+	
+	printf("======== test_eviction_policies ========\n");
+	for (p = 0; p < 4; p++) {
+		printf("Policy %s\n", policies[p]->name);
+		tracker_init(&t, pool, 4, policies[p]);
+		for (i = 0; i < sizeof(script) / sizeof(script[0]); i++) {
+			cur.device_id = script[i];
+			cur.rssi = i;
+			on_discovery(&t, &cur);
+		}
+		print_queue_by_time(&t);
+		
+		TEST_CHECK(t.device_count == 4);
+		for (i = 1; i <= 5; i++) {
+			cur.device_id = i;
+			if (i == expected_victim[p]) {
+				TEST_CHECK(find_duplicate(&t, &cur) == NULL);
+			} else {
+				TEST_CHECK(find_duplicate(&t, &cur) != NULL);
+			}
+		}
+		tracker_destroy(&t);
+	}
+}
+
+// The observation log must keep exactly the same order as the linked list LRU,
+// including across compactions
+#define TEST_LOG_CAPACITY 8
+void test_observation_log(void) {
+	uint8_t list_pool[TRACKER_BYTES(TEST_LOG_CAPACITY)];
+	uint8_t log_pool[TRACKER_BYTES(TEST_LOG_CAPACITY)];
+	log_record_t records[2 * TEST_LOG_CAPACITY];
+	tracker_t list, log;
+	device_t *a, *b;
+	pair_adv_data_t cur = {0};
+	int i;
+	
+	printf("======== test_observation_log ========\n");
+	tracker_init(&list, list_pool, TEST_LOG_CAPACITY, &policy_lru);
+	tracker_init(&log, log_pool, TEST_LOG_CAPACITY, &policy_lru);
+	TEST_CHECK(tracker_use_log(&log, records, 3 * TEST_LOG_CAPACITY) == -1);
+	TEST_CHECK(tracker_use_log(&log, records, 2 * TEST_LOG_CAPACITY) == 0);
+	
+	srand(2020);
+	for (i = 0; i < 2000; i++) {
+		cur.device_id = 1 + rand() % 20;
+		cur.rssi = rand();
+		on_discovery(&list, &cur);
+		on_discovery(&log, &cur);
+		
+		TEST_CHECK(list.device_count == log.device_count);
+		for (a = queue_first(&list), b = queue_first(&log); a != NULL && b != NULL;
+				a = queue_next(&list, a), b = queue_next(&log, b)) {
+			if (a->adv.device_id != b->adv.device_id) break;
+		}
+		TEST_CHECK(a == NULL && b == NULL);
+		if (a != NULL || b != NULL) break;
+	}
+	print_queue_by_time(&log);
+	printf("log head: %u tail: %u\n", log.log_head, log.log_tail);
+	
+	tracker_destroy(&list);
+	tracker_destroy(&log);
+	TEST_CHECK(log.device_count == 0);
+}
+
+// Replay random traffic on a virtual clock and compare against the last time
+// each device was seen. Capacity is large enough that only expiry removes devices.
+#define TEST_EXPIRY_CAPACITY 64
+#define TEST_EXPIRY_DEVICES 50
+void test_expiry_run(unsigned long long max_age_ms, unsigned long long resolution_ms, int max_step_ms) {
+	uint8_t pool[TRACKER_BYTES(TEST_EXPIRY_CAPACITY)];
+	slot_link_t timer_links[TEST_EXPIRY_CAPACITY];
+	unsigned long long last_seen[TEST_EXPIRY_DEVICES + 1] = {0};
+	unsigned long long now = 1581292800000ULL;
+	pair_adv_data_t cur = {0};
+	tracker_t t;
+	int expired = 0;
+	int i, id;
+	
+	printf("max age: %llu ms resolution: %llu ms\n", max_age_ms, resolution_ms);
+	tracker_init(&t, pool, TEST_EXPIRY_CAPACITY, &policy_lru);
+	tracker_set_max_age(&t, max_age_ms, resolution_ms, timer_links);
+	srand(2020);
+	for (i = 0; i < 5000; i++) {
+		now += rand() % max_step_ms;
+		// Half of the devices go quiet for a while every so often
+		cur.device_id = 1 + rand() % ((i / 1000) % 2 ? TEST_EXPIRY_DEVICES / 2 : TEST_EXPIRY_DEVICES);
+		on_discovery_at(&t, &cur, now);
+		last_seen[cur.device_id] = now;
+		expired += tracker_expire(&t, now);
+		
+		for (id = 1; id <= TEST_EXPIRY_DEVICES; id++) {
+			cur.device_id = id;
+			if (last_seen[id] == 0) continue;
+			if (last_seen[id] + max_age_ms > now) {
+				TEST_CHECK(find_duplicate(&t, &cur) != NULL);
+			}
+			if (last_seen[id] + max_age_ms + resolution_ms <= now) {
+				TEST_CHECK(find_duplicate(&t, &cur) == NULL);
+			}
+		}
+	}
+	printf("expired: %d still tracked: %d\n", expired, t.device_count);
+	TEST_CHECK(expired == t.expired_count);
+	
+	// An hour later everything is gone, without stepping through the hour tick by tick
+	now += 3600 * 1000;
+	tracker_expire(&t, now);
+	TEST_CHECK(t.device_count == 0);
+	TEST_CHECK(t.wheel_count == 0);
+	tracker_destroy(&t);
+}
+
+void test_expiry(void) {
+	printf("======== test_expiry ========\n");
+	test_expiry_run(500, 10, 30);
+	test_expiry_run(60 * 1000, 1, 200);
+}
+
+// A device blasting advertisements only moves in the queue once per interval
+void test_rate_limit(void) {
+	const int folds[] = { RSSI_FOLD_MAX, RSSI_FOLD_LATEST };
+	const uint8_t expected_rssi[] = { 50, 30 };
+	uint8_t pool[TRACKER_BYTES(4)];
+	unsigned long long now = 1581292800000ULL;
+	pair_adv_data_t cur = {0};
+	device_t *dev;
+	tracker_t t;
+	int f;
+	
+	printf("======== test_rate_limit ========\n");
+	for (f = 0; f < 2; f++) {
+		tracker_init(&t, pool, 4, &policy_lru);
+		tracker_set_rate_limit(&t, 100, folds[f]);
+		
+		cur.device_id = 1;
+		cur.rssi = 10;
+		on_discovery_at(&t, &cur, now);
+		cur.device_id = 2;
+		on_discovery_at(&t, &cur, now + 1);
+		// Device 1 blasts two more advertisements within the interval
+		cur.device_id = 1;
+		cur.rssi = 50;
+		on_discovery_at(&t, &cur, now + 20);
+		cur.rssi = 30;
+		on_discovery_at(&t, &cur, now + 40);
+		print_queue_by_time(&t);
+		
+		dev = find_duplicate(&t, &cur);
+		TEST_CHECK(t.coalesced_count == 2);
+		TEST_CHECK(dev->adv.rssi == expected_rssi[f]);
+		TEST_CHECK(dev->discovery_time == now);
+		TEST_CHECK(queue_first(&t)->adv.device_id == 2);
+		
+		// The interval has passed, so this one is a normal update
+		cur.rssi = 20;
+		on_discovery_at(&t, &cur, now + 100);
+		TEST_CHECK(t.coalesced_count == 2);
+		TEST_CHECK(dev->adv.rssi == 20);
+		TEST_CHECK(dev->discovery_time == now + 100);
+		TEST_CHECK(queue_first(&t) == dev);
+		tracker_destroy(&t);
+	}
+}
+
+void test_prefilter(void) {
+	const uint32_t ours[] = { 11, 7, 3 };
+	uint32_t denied[1000];
+	uint64_t allow_storage[FILTER_STORAGE_BYTES(3) / sizeof(uint64_t) + 1];
+	uint64_t deny_storage[FILTER_STORAGE_BYTES(1000) / sizeof(uint64_t)];
+	uint8_t pool[TRACKER_BYTES(4)];
+	adv_filter_t allow, deny;
+	pair_adv_data_t cur = {0};
+	tracker_t t;
+	int false_positives = 0;
+	int i;
+	
+	printf("======== test_prefilter ========\n");
+	
+	// Allowlist: our ids, or anything named like one of our pumps
+	filter_init(&allow, FILTER_ALLOW, ours, 3, allow_storage);
+	filter_set_name_prefix(&allow, "PUMP-");
+	tracker_init(&t, pool, 4, &policy_lru);
+	tracker_set_filter(&t, &allow);
+	for (i = 1; i <= 12; i++) {
+		cur.device_id = i;
+		on_discovery(&t, &cur);
+	}
+	cur.device_id = 100;
+	strcpy((char *)cur.device_name, "PUMP-0100");
+	on_discovery(&t, &cur);
+	print_queue_by_time(&t);
+	TEST_CHECK(t.device_count == 4);
+	TEST_CHECK(allow.passed_count == 4);
+	TEST_CHECK(allow.dropped_count == 9);
+	tracker_destroy(&t);
+	
+	// Denylist long enough to go into the Bloom filter
+	for (i = 0; i < 1000; i++) {
+		denied[i] = 5000 + i * 3;
+	}
+	filter_init(&deny, FILTER_DENY, denied, 1000, deny_storage);
+	TEST_CHECK(deny.bloom != NULL);
+	memset(cur.device_name, 0, sizeof(cur.device_name));
+	for (i = 0; i < 1000; i++) {
+		cur.device_id = denied[i];
+		TEST_CHECK(filter_accepts(&deny, &cur) == 0);
+	}
+	for (i = 0; i < 100000; i++) {
+		cur.device_id = 100000 + i;
+		if (!filter_accepts(&deny, &cur)) false_positives++;
+	}
+	printf("bloom bits: %u false positives: %d/100000\n", deny.bloom_bits, false_positives);
+	TEST_CHECK(false_positives < 2000);
+	TEST_CHECK(deny.dropped_count == 1000 + false_positives);
+}
+
+typedef struct visit_check {
+	int visited;
+	int stop_after;
+	uint8_t last_rssi;
+	unsigned long long last_age;
+	int out_of_order;
+} visit_check_t;
+
+int check_rssi_visitor(const device_view_t *view, void *ctx) {
+	visit_check_t *check = ctx;
+	if (check->visited > 0 && view->rssi > check->last_rssi) check->out_of_order++;
+	check->last_rssi = view->rssi;
+	return ++check->visited == check->stop_after;
+}
+
+int check_time_visitor(const device_view_t *view, void *ctx) {
+	visit_check_t *check = ctx;
+	if (check->visited > 0 && view->age_ms < check->last_age) check->out_of_order++;
+	check->last_age = view->age_ms;
+	return ++check->visited == check->stop_after;
+}
+
+void test_visitors(void) {
+	const eviction_policy_t *policies[] = { &policy_lru, &policy_fifo, &policy_lfu, &policy_clock };
+	uint8_t mem[TRACKER_BYTES(16)];
+	unsigned long long now = 1581292800000ULL;
+	pair_adv_data_t cur = {0};
+	unsigned long long oldest;
+	visit_check_t check;
+	tracker_t t;
+	int i, p;
+	
+	printf("======== test_visitors ========\n");
+	for (p = 0; p < 4; p++) {
+		tracker_init(&t, mem, 16, policies[p]);
+		srand(2020);
+		for (i = 0; i < 200; i++) {
+			cur.device_id = 1 + rand() % 24;
+			cur.rssi = rand();
+			on_discovery_at(&t, &cur, now + i * 10);
+		}
+		now += 2000;
+		
+		memset(&check, 0, sizeof(check));
+		TEST_CHECK(tracker_visit_by_time(&t, now, check_time_visitor, &check) == 16);
+		TEST_CHECK(check.visited == 16 && check.out_of_order == 0);
+		oldest = check.last_age;
+		
+		memset(&check, 0, sizeof(check));
+		TEST_CHECK(tracker_visit_by_rssi(&t, now, check_rssi_visitor, &check) == 16);
+		TEST_CHECK(check.visited == 16 && check.out_of_order == 0);
+		printf("Policy %s: oldest age %llu ms, weakest rssi %d\n", policies[p]->name, oldest, check.last_rssi);
+		
+		// Visitors can stop early
+		memset(&check, 0, sizeof(check));
+		check.stop_after = 5;
+		TEST_CHECK(tracker_visit_by_rssi(&t, now, check_rssi_visitor, &check) == 5);
+		memset(&check, 0, sizeof(check));
+		check.stop_after = 5;
+		TEST_CHECK(tracker_visit_by_time(&t, now, check_time_visitor, &check) == 5);
+		tracker_destroy(&t);
+	}
+}
+
+void test_render_table(void) {
+	const char *expected =
+			RENDER_HEADER
+			"7\tPUMP-7\t200\t1500\n"
+			"3\t\t90\t2000\n"
+			"4294967295\tABCDEFGHIJKLMNOP\t0\t0\n";
+	uint8_t mem[TRACKER_BYTES(4)];
+	unsigned long long now = 1581292800000ULL;
+	pair_adv_data_t cur = {0};
+	char buf[RENDER_ROW_MAX * 5];
+	size_t len;
+	tracker_t t;
+	
+	printf("======== test_render_table ========\n");
+	tracker_init(&t, mem, 4, &policy_lru);
+	cur.device_id = 3;
+	cur.rssi = 90;
+	on_discovery_at(&t, &cur, now - 2000);
+	cur.device_id = 7;
+	cur.rssi = 200;
+	strcpy((char *)cur.device_name, "PUMP-7");
+	on_discovery_at(&t, &cur, now - 1500);
+	// Largest id, and a name using all 16 bytes with no terminator
+	cur.device_id = UINT32_MAX;
+	cur.rssi = 0;
+	memcpy(cur.device_name, "ABCDEFGHIJKLMNOP", 16);
+	on_discovery_at(&t, &cur, now);
+	
+	len = tracker_render_table(&t, REPORT_BY_RSSI, now, buf, sizeof(buf));
+	fwrite(buf, 1, len, stdout);
+	TEST_CHECK(len == strlen(expected) && memcmp(buf, expected, len) == 0);
+	
+	// Too small for every row: whole rows get left out
+	len = tracker_render_table(&t, REPORT_BY_RSSI, now, buf, RENDER_ROW_MAX + 40);
+	TEST_CHECK(len == strlen(RENDER_HEADER) + strlen("7\tPUMP-7\t200\t1500\n"));
+	tracker_destroy(&t);
+}
+
+// Top-k must match the front of a full sort, with and without the RSSI index
+#define TEST_TOP_K_CAPACITY 32
+void test_top_k(void) {
+	const int ks[] = { 1, 5, 10, 32, 40 };
+	uint8_t plain_mem[TRACKER_BYTES(TEST_TOP_K_CAPACITY)];
+	uint8_t indexed_mem[TRACKER_BYTES(TEST_TOP_K_CAPACITY)];
+	slot_link_t timer_links[TEST_TOP_K_CAPACITY];
+	slot_link_t rssi_links[TEST_TOP_K_CAPACITY];
+	const device_t *top[40];
+	const device_t *top_indexed[40];
+	unsigned long long now = 1581292800000ULL;
+	pair_adv_data_t cur = {0};
+	tracker_t plain, indexed;
+	int i, k, n, sorted;
+	
+	printf("======== test_top_k ========\n");
+	tracker_init(&plain, plain_mem, TEST_TOP_K_CAPACITY, &policy_lru);
+	tracker_init(&indexed, indexed_mem, TEST_TOP_K_CAPACITY, &policy_lru);
+	// Exercise every path that changes RSSI or removes devices
+	tracker_set_rate_limit(&indexed, 50, RSSI_FOLD_MAX);
+	tracker_set_max_age(&indexed, 2000, 10, timer_links);
+	tracker_use_rssi_index(&indexed, rssi_links);
+	
+	srand(2020);
+	for (i = 0; i < 3000; i++) {
+		now += rand() % 20;
+		cur.device_id = 1 + rand() % (i < 1500 ? 60 : 20);
+		cur.rssi = rand() % 64;
+		on_discovery_at(&plain, &cur, now);
+		on_discovery_at(&indexed, &cur, now);
+		tracker_expire(&indexed, now);
+		
+		if (i % 100 != 99) continue;
+		sorted = tracker_sort_by_rssi(&plain);
+		for (k = 0; k < sizeof(ks) / sizeof(ks[0]); k++) {
+			n = tracker_top_k_by_rssi(&plain, ks[k], top);
+			TEST_CHECK(n == (ks[k] < sorted ? ks[k] : sorted));
+			TEST_CHECK(memcmp(top, plain.sorted, n * sizeof(top[0])) == 0);
+		}
+		
+		sorted = tracker_sort_by_rssi(&indexed);
+		for (k = 0; k < sizeof(ks) / sizeof(ks[0]); k++) {
+			n = tracker_top_k_by_rssi(&indexed, ks[k], top_indexed);
+			TEST_CHECK(n == (ks[k] < sorted ? ks[k] : sorted));
+			while (n-- > 0) {
+				// Ties may be in a different order, RSSI can't be
+				if (top_indexed[n]->adv.rssi != indexed.sorted[n]->adv.rssi) break;
+			}
+			TEST_CHECK(n < 0);
+		}
+	}
+	n = tracker_top_k_by_rssi(&indexed, 5, top_indexed);
+	printf("top %d of %d:", n, indexed.device_count);
+	for (i = 0; i < n; i++) printf(" %u (%d)", top_indexed[i]->adv.device_id, top_indexed[i]->adv.rssi);
+	printf("\n");
+	TEST_CHECK(tracker_top_k_by_rssi(&indexed, 0, top_indexed) == 0);
+	
+	tracker_destroy(&plain);
+	tracker_destroy(&indexed);
+	TEST_CHECK(indexed.rssi_bitmap[0] == 0 && indexed.rssi_bitmap[1] == 0);
+}
+
+// A dashboard's copy of the device table, kept up to date with delta reports only
+#define TEST_DELTA_DEVICES 64
+typedef struct delta_mirror {
+	int present[TEST_DELTA_DEVICES + 1];
+	uint8_t rssi[TEST_DELTA_DEVICES + 1];
+	unsigned long long time[TEST_DELTA_DEVICES + 1];
+} delta_mirror_t;
+
+int apply_change_visitor(const device_change_t *change, void *ctx) {
+	delta_mirror_t *mirror = ctx;
+	mirror->present[change->device_id] = change->kind != CHANGE_EVICTED;
+	if (change->device != NULL) {
+		mirror->rssi[change->device_id] = change->device->adv.rssi;
+		mirror->time[change->device_id] = change->device->discovery_time;
+	}
+	return 0;
+}
+
+void test_delta_reports(void) {
+	uint8_t mem[TRACKER_BYTES(16)];
+	slot_link_t timer_links[16];
+	change_link_t change_links[16];
+	unsigned long long now = 1581292800000ULL;
+	unsigned long long gen = 0;
+	pair_adv_data_t cur = {0};
+	delta_mirror_t mirror;
+	device_t *dev;
+	tracker_t t;
+	int changes = 0;
+	int events = 0;
+	int i, id, n;
+	
+	printf("======== test_delta_reports ========\n");
+	memset(&mirror, 0, sizeof(mirror));
+	tracker_init(&t, mem, 16, &policy_lru);
+	tracker_set_max_age(&t, 1000, 10, timer_links);
+	tracker_set_rate_limit(&t, 30, RSSI_FOLD_LATEST);
+	tracker_track_changes(&t, change_links);
+	
+	srand(2020);
+	for (i = 0; i < 5000; i++) {
+		now += rand() % 20;
+		// Mostly a steady set of devices, with bursts of newcomers
+		cur.device_id = 1 + rand() % ((i / 500) % 2 ? TEST_DELTA_DEVICES : 12);
+		cur.rssi = rand() % 4;
+		on_discovery_at(&t, &cur, now);
+		tracker_expire(&t, now);
+		events++;
+		
+		if (i % 10 != 9) continue;
+		n = tracker_report_changes_since(&t, gen, apply_change_visitor, &mirror);
+		TEST_CHECK(n >= 0);
+		gen = t.generation;
+		changes += n;
+		
+		for (id = 1; id <= TEST_DELTA_DEVICES; id++) {
+			cur.device_id = id;
+			dev = find_duplicate(&t, &cur);
+			TEST_CHECK(mirror.present[id] == (dev != NULL));
+			if (dev != NULL) {
+				TEST_CHECK(mirror.rssi[id] == dev->adv.rssi);
+				TEST_CHECK(mirror.time[id] == dev->discovery_time);
+			}
+		}
+	}
+	printf("events: %d changes reported: %d generation: %llu\n", events, changes, t.generation);
+	TEST_CHECK(tracker_report_changes_since(&t, t.generation, apply_change_visitor, &mirror) == 0);
+	
+	// After more evictions than the log holds, an old generation needs a full report
+	for (i = 0; i < EVICTION_LOG_SIZE + 1; i++) {
+		cur.device_id = 1000 + i;
+		on_discovery_at(&t, &cur, now);
+	}
+	TEST_CHECK(tracker_report_changes_since(&t, gen, apply_change_visitor, &mirror) == -1);
+	tracker_destroy(&t);
+}
+
+// A writer thread hammers the tracker while the main thread reads snapshots.
+// Every advertisement is self-consistent (name bytes encode the id, time
+// encodes the RSSI), so a torn copy would show up as a mismatch.
+#define TEST_SNAPSHOT_CAPACITY 32
+#define TEST_SNAPSHOT_BASE_TIME 1581292800000ULL
+
+typedef struct snapshot_writer {
+	tracker_t *t;
+	int events;
+	atomic_int done;
+} snapshot_writer_t;
+
+void * snapshot_writer_thread(void *arg) {
+	snapshot_writer_t *writer = arg;
+	pair_adv_data_t cur = {0};
+	uint32_t seed = 2020;
+	int i;
+	for (i = 0; i < writer->events; i++) {
+		seed = seed * 1103515245 + 12345;
+		cur.device_id = 1 + (seed >> 8) % 48;
+		cur.rssi = seed >> 24;
+		memset(cur.device_name, cur.device_id, sizeof(cur.device_name));
+		on_discovery_at(writer->t, &cur, TEST_SNAPSHOT_BASE_TIME + (unsigned long long)i * 256 + cur.rssi);
+	}
+	atomic_store(&writer->done, 1);
+	return NULL;
+}
+
+int snapshot_entry_torn(const snapshot_entry_t *entry) {
+	int i;
+	for (i = 0; i < 16; i++) {
+		if (entry->device_name[i] != entry->device_id) return 1;
+	}
+	return (entry->discovery_time - TEST_SNAPSHOT_BASE_TIME) % 256 != entry->rssi;
+}
+
+void test_snapshot(void) {
+	uint8_t mem[TRACKER_BYTES(TEST_SNAPSHOT_CAPACITY)];
+	snapshot_record_t records[TEST_SNAPSHOT_CAPACITY];
+	snapshot_entry_t entries[TEST_SNAPSHOT_CAPACITY];
+	snapshot_writer_t writer;
+	snapshot_t snap;
+	pthread_t thread;
+	tracker_t t;
+	int reads = 0;
+	int torn = 0;
+	int i, n;
+	
+	printf("======== test_snapshot ========\n");
+	tracker_init(&t, mem, TEST_SNAPSHOT_CAPACITY, &policy_lru);
+	snapshot_init(&snap, records, TEST_SNAPSHOT_CAPACITY);
+	tracker_set_snapshot(&t, &snap);
+	
+	writer.t = &t;
+	writer.events = 300000;
+	atomic_init(&writer.done, 0);
+	pthread_create(&thread, NULL, snapshot_writer_thread, &writer);
+	while (!atomic_load(&writer.done)) {
+		n = snapshot_read(&snap, entries, reads % 2);
+		for (i = 0; i < n; i++) torn += snapshot_entry_torn(&entries[i]);
+		reads++;
+	}
+	pthread_join(thread, NULL);
+	printf("reads: %d torn entries: %d\n", reads, torn);
+	TEST_CHECK(torn == 0);
+	
+	// Once the writer is done, the snapshot matches the tracker
+	n = snapshot_read(&snap, entries, 1);
+	TEST_CHECK(n == t.device_count);
+	for (i = 0; i < n; i++) {
+		pair_adv_data_t lookup = {0};
+		device_t *dev;
+		lookup.device_id = entries[i].device_id;
+		dev = find_duplicate(&t, &lookup);
+		TEST_CHECK(dev != NULL && dev->adv.rssi == entries[i].rssi && dev->discovery_time == entries[i].discovery_time);
+	}
+	tracker_destroy(&t);
+	TEST_CHECK(snapshot_read(&snap, entries, 1) == 0);
+}
+
+typedef struct id_collector {
+	uint32_t ids[TRACKER_CAPACITY];
+	int count;
+} id_collector_t;
+
+int id_collector_visitor(const device_view_t *view, void *ctx) {
+	id_collector_t *c = ctx;
+	c->ids[c->count++] = view->device_id;
+	return c->count == TRACKER_CAPACITY;
+}
+
+// Same seed, same stream; and each workload has the shape it claims
+void test_workloads(void) {
+	static uint32_t seen[2048];
+	pair_adv_data_t a = {0}, b = {0};
+	unsigned long long prev, ts;
+	workload_t w1, w2;
+	uint32_t distinct, top, max_id, last_id;
+	int kind, i, longest, run;
+	
+	printf("======== test_workloads ========\n");
+	for (kind = WORKLOAD_STEADY; kind <= WORKLOAD_BURSTY; kind++) {
+		workload_init(&w1, kind, 7, 1000);
+		workload_init(&w2, kind, 7, 1000);
+		memset(seen, 0, sizeof(seen));
+		distinct = 0;
+		max_id = 0;
+		longest = run = 0;
+		last_id = 0;
+		prev = 1000;
+		for (i = 0; i < 20000; i++) {
+			ts = workload_next(&w1, &a);
+			TEST_CHECK(workload_next(&w2, &b) == ts);
+			TEST_CHECK(memcmp(&a, &b, sizeof(a)) == 0);
+			TEST_CHECK(ts >= prev);
+			prev = ts;
+			if (a.device_id < 2048 && seen[a.device_id]++ == 0) distinct++;
+			if (a.device_id > max_id) max_id = a.device_id;
+			run = a.device_id == last_id ? run + 1 : 1;
+			if (run > longest) longest = run;
+			last_id = a.device_id;
+		}
+		// Most popular device
+		for (top = 1, i = 1; i < 2048; i++) {
+			if (seen[i] > seen[top]) top = i;
+		}
+		printf("kind: %d distinct (ids < 2048): %u max id: %u busiest: %u (%u events) longest run: %d virtual ms: %llu\n",
+				kind, distinct, max_id, top, seen[top], longest, w1.now - 1000);
+		switch (kind) {
+		case WORKLOAD_STEADY:
+			TEST_CHECK(distinct == 20 && seen[1] == 1000);
+			// About once a second each
+			TEST_CHECK(w1.now - 1000 > 950000 && w1.now - 1000 < 1050000);
+			break;
+		case WORKLOAD_TRADESHOW:
+			TEST_CHECK(max_id > 1000 + 20000 / 16);
+			TEST_CHECK(top <= WORKLOAD_LONG_LIVED);
+			break;
+		case WORKLOAD_ZIPF:
+			TEST_CHECK(top == 1 && seen[1] > seen[2] && seen[2] > seen[10]);
+			TEST_CHECK(max_id <= 1000);
+			break;
+		case WORKLOAD_BURSTY:
+			TEST_CHECK(max_id <= 50 && longest >= 100);
+			break;
+		}
+	}
+}
+
+#define TEST_TRACE_EVENTS 20000
+
+// Record a stream through one tracker, replay it into another, and they have to end up the same
+void test_trace(void) {
+	uint8_t mem_a[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_b[TRACKER_BYTES(TRACKER_CAPACITY)];
+	char path[] = "/tmp/test_trace_XXXXXX";
+	static uint8_t seen[4096];
+	trace_recorder_t rec;
+	trace_replay_t replay;
+	pair_adv_data_t cur = {0};
+	unsigned long long ts, before;
+	tracker_t a, b;
+	device_t *x, *y;
+	uint32_t distinct = 0;
+	struct stat st;
+	FILE *file;
+	workload_t w;
+	int fd, i;
+	
+	printf("======== test_trace ========\n");
+	fd = mkstemp(path);
+	TEST_CHECK(fd >= 0);
+	close(fd);
+	
+	tracker_init(&a, mem_a, TRACKER_CAPACITY, &policy_lru);
+	TEST_CHECK(trace_recorder_open(&rec, path) == 0);
+	tracker_set_recorder(&a, &rec);
+	workload_init(&w, WORKLOAD_TRADESHOW, 40, 1581292800000ULL);
+	for (i = 0; i < TEST_TRACE_EVENTS; i++) {
+		ts = workload_next(&w, &cur);
+		memcpy(cur.device_data, &cur.rf_address, sizeof(cur.rf_address));
+		if (cur.device_id < sizeof(seen) && !seen[cur.device_id]) {
+			seen[cur.device_id] = 1;
+			distinct++;
+		}
+		on_discovery_at(&a, &cur, ts);
+	}
+	tracker_set_recorder(&a, NULL);
+	TEST_CHECK(trace_recorder_close(&rec) == 0);
+	
+	TEST_CHECK(trace_replay_open(&replay, path) == 0);
+	TEST_CHECK(replay.header->record_count == TEST_TRACE_EVENTS);
+	TEST_CHECK(replay.header->payload_count == distinct);
+	TEST_CHECK(stat(path, &st) == 0 && st.st_size == sizeof(trace_header_t) +
+			TEST_TRACE_EVENTS * sizeof(trace_record_t) + distinct * sizeof(trace_payload_t));
+	printf("records: %d payloads: %u bytes: %lld (%.1f per advertisement, %d raw)\n",
+			TEST_TRACE_EVENTS, distinct, (long long)st.st_size,
+			(double)st.st_size / TEST_TRACE_EVENTS, (int)(sizeof(pair_adv_data_t) + sizeof(unsigned long long)));
+	
+	tracker_init(&b, mem_b, TRACKER_CAPACITY, &policy_lru);
+	TEST_CHECK(trace_replay(&replay, &b, TRACE_SPEED_MAX) == TEST_TRACE_EVENTS);
+	TEST_CHECK(a.device_count == b.device_count);
+	for (x = queue_first(&a), y = queue_first(&b); x != NULL && y != NULL; x = queue_next(&a, x), y = queue_next(&b, y)) {
+		TEST_CHECK(x->adv.device_id == y->adv.device_id && device_rf_address(&a, x) == device_rf_address(&b, y) && x->adv.rssi == y->adv.rssi);
+		TEST_CHECK(memcmp(device_name(&a, x), device_name(&b, y), 16) == 0);
+		TEST_CHECK(memcmp(device_data(&a, x), device_data(&b, y), 64) == 0);
+		TEST_CHECK(x->discovery_time == y->discovery_time);
+	}
+	TEST_CHECK(x == NULL && y == NULL);
+	trace_replay_close(&replay);
+	tracker_destroy(&a);
+	tracker_destroy(&b);
+	
+	// A clock that starts at 0 is fine, timestamp 0 included
+	TEST_CHECK(trace_recorder_open(&rec, path) == 0);
+	for (i = 0; i < 4; i++) {
+		cur.device_id = i + 1;
+		trace_record(&rec, &cur, i);
+	}
+	TEST_CHECK(trace_recorder_close(&rec) == 0);
+	TEST_CHECK(trace_replay_open(&replay, path) == 0);
+	tracker_init(&b, mem_b, TRACKER_CAPACITY, &policy_lru);
+	TEST_CHECK(trace_replay(&replay, &b, TRACE_SPEED_MAX) == 4);
+	TEST_CHECK(b.device_count == 4 && b.tail->adv.device_id == 1 && b.tail->discovery_time == 0);
+	trace_replay_close(&replay);
+	tracker_destroy(&b);
+	
+	// Recorded speed waits out the gaps and moves the timestamps to now
+	TEST_CHECK(trace_recorder_open(&rec, path) == 0);
+	for (i = 0; i < 4; i++) {
+		cur.device_id = i + 1;
+		trace_record(&rec, &cur, 5000 + i * 10);
+	}
+	TEST_CHECK(trace_recorder_close(&rec) == 0);
+	TEST_CHECK(trace_replay_open(&replay, path) == 0);
+	tracker_init(&b, mem_b, TRACKER_CAPACITY, &policy_lru);
+	before = systime_ms_get();
+	TEST_CHECK(trace_replay(&replay, &b, TRACE_SPEED_RECORDED) == 4);
+	TEST_CHECK(systime_ms_get() - before >= 29);
+	TEST_CHECK(b.head->adv.device_id == 4 && b.head->discovery_time >= before + 30 && b.tail->discovery_time >= before);
+	trace_replay_close(&replay);
+	tracker_destroy(&b);
+	
+	// Anything that isn't a complete trace gets turned away
+	file = fopen(path, "r+b");
+	TEST_CHECK(file != NULL && fwrite("NOTATRACE", 1, 8, file) == 8);
+	fclose(file);
+	TEST_CHECK(trace_replay_open(&replay, path) == -1);
+	TEST_CHECK(truncate(path, sizeof(trace_header_t) + 10) == 0);
+	TEST_CHECK(trace_replay_open(&replay, path) == -1);
+	unlink(path);
+}
+
+// Same devices in the same order with the same data, and the indexes agree
+int tracker_same(tracker_t *a, tracker_t *b) {
+	const device_t *top_a[8], *top_b[8];
+	device_t *x, *y;
+	int n, i;
+	if (a->device_count != b->device_count) return 0;
+	for (x = queue_first(a), y = queue_first(b); x != NULL && y != NULL; x = queue_next(a, x), y = queue_next(b, y)) {
+		if (x->adv.device_id != y->adv.device_id || x->adv.rssi != y->adv.rssi || x->discovery_time != y->discovery_time) return 0;
+		if (tracker_find(a, x->adv.device_id) != x) return 0;
+	}
+	if (x != NULL || y != NULL) return 0;
+	n = tracker_top_k_by_rssi(a, 8, top_a);
+	if (tracker_top_k_by_rssi(b, 8, top_b) != n) return 0;
+	for (i = 0; i < n; i++) {
+		if (top_a[i]->adv.rssi != top_b[i]->adv.rssi) return 0;
+	}
+	return 1;
+}
+
+// Warm restarts at the same address and at a new one, against a tracker that never restarted
+void test_persist(void) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	slot_link_t timer_links[TRACKER_CAPACITY];
+	slot_link_t rssi_links[TRACKER_CAPACITY];
+	change_link_t change_links[TRACKER_CAPACITY];
+	char path[] = "/tmp/test_persist_XXXXXX";
+	pair_adv_data_t cur = {0};
+	unsigned long long ts;
+	void *base, *blocker;
+	tracker_t reference;
+	tracker_t *t;
+	workload_t w;
+	int restored, fd, i;
+	
+	printf("======== test_persist ========\n");
+	if (!USE_FIXED_POOL) {
+		printf("needs USE_FIXED_POOL, skipped\n");
+		return;
+	}
+	fd = mkstemp(path);
+	TEST_CHECK(fd >= 0);
+	close(fd);
+	
+	// Everything that keeps links: queue, id index, timer wheel, RSSI index, change list.
+	// The persistent tracker brings its own link memory.
+	tracker_init(&reference, mem, TRACKER_CAPACITY, &policy_lru);
+	tracker_set_max_age(&reference, 500, 10, timer_links);
+	tracker_use_rssi_index(&reference, rssi_links);
+	tracker_track_changes(&reference, change_links);
+	t = tracker_persist_open(path, TRACKER_CAPACITY, &policy_lru, &restored);
+	TEST_CHECK(t != NULL && !restored);
+	TEST_CHECK(tracker_set_max_age(t, 500, 10, NULL) == 0);
+	TEST_CHECK(tracker_use_rssi_index(t, NULL) == 0);
+	TEST_CHECK(tracker_track_changes(t, NULL) == 0);
+	
+	workload_init(&w, WORKLOAD_TRADESHOW, 42, 1581292800000ULL);
+	w.population = 40;
+	for (i = 0; i < 3000; i++) {
+		ts = workload_next(&w, &cur);
+		on_discovery_at(&reference, &cur, ts);
+		on_discovery_at(t, &cur, ts);
+		if (i % 1000 != 999) continue;
+		tracker_expire(&reference, ts);
+		tracker_expire(t, ts);
+		
+		base = t->persist;
+		tracker_persist_close(t);
+		blocker = NULL;
+		if (i == 1999) {
+			// Something else took the old address, so the state has to move
+			blocker = mmap(base, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+			TEST_CHECK(blocker == base);
+		}
+		t = tracker_persist_open(path, TRACKER_CAPACITY, &policy_lru, &restored);
+		TEST_CHECK(t != NULL && restored);
+		printf("restart after %d: %d devices, %s\n", i + 1, t->device_count, (void *)t->persist == base ? "same address" : "relocated");
+		TEST_CHECK(((void *)t->persist == base) == (blocker == NULL));
+		TEST_CHECK(tracker_same(&reference, t));
+		if (blocker != NULL) munmap(blocker, 4096);
+	}
+	TEST_CHECK(tracker_same(&reference, t));
+	TEST_CHECK(tracker_expire(&reference, ts + 1000) == tracker_expire(t, ts + 1000));
+	TEST_CHECK(t->device_count == 0);
+	
+	// A crash mid-update, or another policy, and it starts empty
+	on_discovery_at(t, &cur, ts + 1000);
+	t->persist->in_update = 1;
+	tracker_persist_close(t);
+	t = tracker_persist_open(path, TRACKER_CAPACITY, &policy_lru, &restored);
+	TEST_CHECK(t != NULL && !restored && t->device_count == 0);
+	on_discovery_at(t, &cur, ts + 1000);
+	tracker_persist_close(t);
+	t = tracker_persist_open(path, TRACKER_CAPACITY, &policy_fifo, &restored);
+	TEST_CHECK(t != NULL && !restored && t->device_count == 0);
+	tracker_persist_close(t);
+	TEST_CHECK(tracker_persist_open(path, TRACKER_CAPACITY, &policy_log, &restored) == NULL);
+	tracker_destroy(&reference);
+	unlink(path);
+}
+
+// Round trip through tracker_serialize() for each queue layout, with and without the payload
+void test_serialize(void) {
+	const eviction_policy_t *policies[] = { &policy_lru, &policy_fifo, &policy_log };
+	uint8_t mem_a[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_b[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t buf[SERIALIZE_MAX_BYTES(TRACKER_CAPACITY)];
+	log_record_t log_a[2 * TRACKER_CAPACITY], log_b[2 * TRACKER_CAPACITY];
+	snapshot_record_t records[TRACKER_CAPACITY];
+	snapshot_entry_t entries[TRACKER_CAPACITY];
+	pair_adv_data_t cur = {0};
+	unsigned long long ts;
+	snapshot_t snap;
+	uint64_t seq;
+	size_t len, bare;
+	tracker_t a, b;
+	device_t *x, *y;
+	workload_t w;
+	int p, i;
+	
+	printf("======== test_serialize ========\n");
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		tracker_init(&a, mem_a, TRACKER_CAPACITY, policies[p]);
+		if (policies[p] == &policy_log) tracker_use_log(&a, log_a, 2 * TRACKER_CAPACITY);
+		workload_init(&w, WORKLOAD_TRADESHOW, 43, 1581292800000ULL);
+		w.population = 40;
+		for (i = 0; i < 5000; i++) {
+			ts = workload_next(&w, &cur);
+			memcpy(cur.device_data, cur.device_name, 8);
+			on_discovery_at(&a, &cur, ts);
+		}
+		
+		bare = tracker_serialize(&a, 0, buf, sizeof(buf));
+		len = tracker_serialize(&a, SERIALIZE_PAYLOAD, buf, sizeof(buf));
+		printf("policy: %s devices: %d bytes: %zu (%zu without payload, %zu in memory)\n",
+				policies[p]->name, a.device_count, len, bare, a.device_count * DEVICE_BLOCK_BYTES);
+		TEST_CHECK(bare > 0 && len > bare && len <= SERIALIZE_MAX_BYTES(a.device_count));
+		TEST_CHECK(tracker_serialize(&a, SERIALIZE_PAYLOAD, buf, len - 1) == 0);
+		
+		tracker_init(&b, mem_b, TRACKER_CAPACITY, policies[p]);
+		if (policies[p] == &policy_log) tracker_use_log(&b, log_b, 2 * TRACKER_CAPACITY);
+		TEST_CHECK(tracker_deserialize(&b, buf, len) == a.device_count);
+		TEST_CHECK(tracker_same(&a, &b));
+		for (x = queue_first(&a), y = queue_first(&b); x != NULL && y != NULL; x = queue_next(&a, x), y = queue_next(&b, y)) {
+			TEST_CHECK(memcmp(device_name(&a, x), device_name(&b, y), 16) == 0);
+			TEST_CHECK(memcmp(device_data(&a, x), device_data(&b, y), 64) == 0);
+			TEST_CHECK(device_rf_address(&a, x) == device_rf_address(&b, y));
+		}
+		
+		// Both trackers carry on the same from here
+		for (i = 0; i < 500; i++) {
+			ts = workload_next(&w, &cur);
+			on_discovery_at(&a, &cur, ts);
+			on_discovery_at(&b, &cur, ts);
+		}
+		TEST_CHECK(tracker_same(&a, &b));
+		tracker_destroy(&b);
+		
+		tracker_init(&b, mem_b, TRACKER_CAPACITY, policies[p]);
+		if (policies[p] == &policy_log) tracker_use_log(&b, log_b, 2 * TRACKER_CAPACITY);
+		bare = tracker_serialize(&a, 0, buf, sizeof(buf));
+		TEST_CHECK(tracker_deserialize(&b, buf, bare) == a.device_count);
+		TEST_CHECK(tracker_same(&a, &b));
+		TEST_CHECK(device_name(&b, queue_first(&b))[0] == 0);
+		tracker_destroy(&b);
+		tracker_destroy(&a);
+	}
+	// A cut off table restores what it can
+	tracker_init(&b, mem_b, TRACKER_CAPACITY, &policy_lru);
+	TEST_CHECK(tracker_deserialize(&b, buf, bare - 1) == -1);
+	TEST_CHECK(b.device_count == TRACKER_CAPACITY - 1);
+	buf[0] = 'X';
+	TEST_CHECK(tracker_deserialize(&b, buf, bare) == -1);
+	tracker_destroy(&b);
+	
+	// Restoring into a full tracker: every evict and insert is one change to snapshot readers
+	tracker_init(&a, mem_a, TRACKER_CAPACITY, &policy_lru);
+	tracker_init(&b, mem_b, TRACKER_CAPACITY, &policy_lru);
+	for (i = 0; i < TRACKER_CAPACITY; i++) {
+		cur.device_id = 1000 + i;
+		on_discovery_at(&a, &cur, 1 + i);
+		cur.device_id = 2000 + i;
+		on_discovery_at(&b, &cur, 1 + i);
+	}
+	snapshot_init(&snap, records, TRACKER_CAPACITY);
+	tracker_set_snapshot(&b, &snap);
+	seq = atomic_load(snap.seq);
+	len = tracker_serialize(&a, 0, buf, sizeof(buf));
+	TEST_CHECK(tracker_deserialize(&b, buf, len) == TRACKER_CAPACITY);
+	TEST_CHECK(atomic_load(snap.seq) - seq == 2 * TRACKER_CAPACITY);
+	TEST_CHECK(snapshot_read(&snap, entries, 1) == TRACKER_CAPACITY);
+	tracker_destroy(&a);
+	tracker_destroy(&b);
+}
+
+#define TEST_SHM_READS 2000
+
+// A child process reads the table while the parent keeps the tracker busy
+void test_shm_export(void) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	snapshot_entry_t entries[TRACKER_CAPACITY];
+	char name[64];
+	char expected[16];
+	pair_adv_data_t cur = {0};
+	shm_export_t exp, other;
+	shm_view_t view, stale;
+	workload_t w;
+	tracker_t t;
+	pid_t child;
+	int status, bad, reads, i, n;
+	
+	printf("======== test_shm_export ========\n");
+	snprintf(name, sizeof(name), "/proprietary_ble_test_%d", (int)getpid());
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	workload_init(&w, WORKLOAD_TRADESHOW, 44, 1581292800000ULL);
+	for (i = 0; i < 100; i++) {
+		unsigned long long ts = workload_next(&w, &cur);
+		on_discovery_at(&t, &cur, ts);
+	}
+	// Devices tracked before the export show up too
+	TEST_CHECK(shm_export_create(&exp, name, &t) == 0);
+	
+	fflush(stdout);
+	child = fork();
+	if (child == 0) {
+		bad = 0;
+		if (shm_view_open(&view, name) != 0 || view.snap.capacity != TRACKER_CAPACITY) _exit(100);
+		for (reads = 0; reads < TEST_SHM_READS; reads++) {
+			n = snapshot_read(&view.snap, entries, 1);
+			if (n != TRACKER_CAPACITY) bad++;
+			for (i = 0; i < n; i++) {
+				// Workload names are derived from the id, so a mismatch would be a torn record
+				memset(expected, 0, sizeof(expected));
+				memcpy(expected, "ble_", 4);
+				*render_u64(expected + 4, entries[i].device_id) = 0;
+				if (memcmp(expected, entries[i].device_name, sizeof(expected)) != 0) bad++;
+			}
+			if (reads % 64 == 0) sched_yield();
+		}
+		shm_view_close(&view);
+		_exit(bad > 99 ? 99 : bad);
+	}
+	TEST_CHECK(child > 0);
+	for (i = 0; i < 200000; i++) {
+		unsigned long long ts = workload_next(&w, &cur);
+		on_discovery_at(&t, &cur, ts);
+		if (i % 1000 == 0) sched_yield();
+	}
+	TEST_CHECK(waitpid(child, &status, 0) == child);
+	printf("reader exit status: %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	
+	// In process, a view matches the tracker exactly
+	TEST_CHECK(shm_view_open(&view, name) == 0);
+	n = snapshot_read(&view.snap, entries, 1);
+	TEST_CHECK(n == t.device_count);
+	for (i = 0; i < n; i++) {
+		pair_adv_data_t lookup = {0};
+		device_t *dev;
+		lookup.device_id = entries[i].device_id;
+		dev = find_duplicate(&t, &lookup);
+		TEST_CHECK(dev != NULL && dev->discovery_time == entries[i].discovery_time && dev->adv.rssi == entries[i].rssi);
+	}
+	// A second exporter doesn't get to take over a live one's table
+	TEST_CHECK(shm_export_create(&other, name, &t) == -1);
+	TEST_CHECK(t.snapshot == &exp.snap && snapshot_read(&view.snap, entries, 1) == n);
+	shm_export_destroy(&exp, &t);
+	TEST_CHECK(t.snapshot == NULL);
+	// Unlinked, but a reader that already had it mapped still can read
+	TEST_CHECK(snapshot_read(&view.snap, entries, 1) == n);
+	shm_view_close(&view);
+	TEST_CHECK(shm_view_open(&view, name) == -1);
+	
+	// A writer that died without cleaning up leaves its segment behind; the next one replaces it
+	fflush(stdout);
+	child = fork();
+	if (child == 0) _exit(shm_export_create(&other, name, &t) == 0 ? 0 : 1);
+	TEST_CHECK(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	TEST_CHECK(shm_view_open(&stale, name) == 0 && stale.table->writer_pid == child);
+	TEST_CHECK(shm_export_create(&exp, name, &t) == 0);
+	TEST_CHECK(shm_view_open(&view, name) == 0 && view.table->writer_pid == getpid());
+	TEST_CHECK(snapshot_read(&view.snap, entries, 1) == t.device_count);
+	// The old mapping is its own segment, still whole
+	TEST_CHECK(snapshot_read(&stale.snap, entries, 1) == n && stale.table->writer_pid == child);
+	shm_view_close(&stale);
+	shm_view_close(&view);
+	shm_export_destroy(&exp, &t);
+	tracker_destroy(&t);
+}
+
+#define TEST_QUERY_CLIENTS 40
+#define TEST_QUERY_PIPELINED 200
+
+// Many clients at once, one of them pipelining more than the socket buffers hold
+void test_query_server(void) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	snapshot_record_t records[TRACKER_CAPACITY];
+	uint8_t resp[SERVER_RESPONSE_MAX];
+	uint8_t req[SERVER_REQUEST_BYTES] = { SERVER_OP_TOP_N, 0, 0, 0, SERVER_TOP_MAX };
+	int fds[SERVER_MAX_CLIENTS + 1];
+	const device_t *top[5];
+	pair_adv_data_t cur = {0};
+	query_server_t srv;
+	snapshot_t snap;
+	char path[64];
+	workload_t w;
+	tracker_t t;
+	device_t *dev;
+	int greedy, i, c, n, ok;
+	
+	printf("======== test_query_server ========\n");
+	snprintf(path, sizeof(path), "/tmp/test_query_%d.sock", (int)getpid());
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	snapshot_init(&snap, records, TRACKER_CAPACITY);
+	tracker_set_snapshot(&t, &snap);
+	workload_init(&w, WORKLOAD_TRADESHOW, 45, 1581292800000ULL);
+	for (i = 0; i < 2000; i++) {
+		unsigned long long ts = workload_next(&w, &cur);
+		on_discovery_at(&t, &cur, ts);
+	}
+	TEST_CHECK(query_server_start(&srv, path, &snap) == 0);
+	
+	// This one asks for a lot and doesn't read any of it yet
+	greedy = query_connect(path);
+	TEST_CHECK(greedy >= 0);
+	for (i = 0; i < TEST_QUERY_PIPELINED; i++) {
+		TEST_CHECK(send(greedy, req, sizeof(req), 0) == sizeof(req));
+	}
+	
+	ok = 0;
+	n = tracker_top_k_by_rssi(&t, 5, top);
+	dev = queue_first(&t);
+	for (c = 0; c < TEST_QUERY_CLIENTS; c++) {
+		fds[c] = query_connect(path);
+		if (fds[c] < 0) continue;
+		if (query_request(fds[c], SERVER_OP_STATS, 0, resp) != SERVER_HEADER_BYTES + SERVER_RECORD_BYTES ||
+				server_get_u32(&resp[SERVER_HEADER_BYTES]) != t.device_count) continue;
+		if (query_request(fds[c], SERVER_OP_TOP_N, 5, resp) != SERVER_HEADER_BYTES + n * SERVER_RECORD_BYTES) continue;
+		for (i = 0; i < n; i++) {
+			if (resp[SERVER_HEADER_BYTES + i * SERVER_RECORD_BYTES + 4] != top[i]->adv.rssi) break;
+		}
+		if (i < n) continue;
+		if (query_request(fds[c], SERVER_OP_LOOKUP, dev->adv.device_id, resp) != SERVER_HEADER_BYTES + SERVER_RECORD_BYTES ||
+				server_get_u64(&resp[SERVER_HEADER_BYTES + 8]) != dev->discovery_time) continue;
+		if (query_request(fds[c], SERVER_OP_LOOKUP, UINT32_MAX, resp) != SERVER_HEADER_BYTES || resp[1] != SERVER_NOT_FOUND) continue;
+		if (query_request(fds[c], 99, 0, resp) != SERVER_HEADER_BYTES || resp[1] != SERVER_BAD_REQUEST) continue;
+		ok++;
+	}
+	printf("clients answered: %d of %d\n", ok, TEST_QUERY_CLIENTS);
+	TEST_CHECK(ok == TEST_QUERY_CLIENTS);
+	
+	// Every pipelined request still gets its answer, in order
+	for (i = 0; i < TEST_QUERY_PIPELINED; i++) {
+		int len = 0, want = SERVER_HEADER_BYTES + t.device_count * SERVER_RECORD_BYTES;
+		while (len < want) {
+			ssize_t got = recv(greedy, &resp[len], want - len, 0);
+			if (got <= 0) break;
+			len += got;
+		}
+		if (len != want || resp[0] != SERVER_OP_TOP_N || server_get_u32(&resp[4]) != t.device_count) break;
+	}
+	TEST_CHECK(i == TEST_QUERY_PIPELINED);
+	
+	// Past the client limit, the connection just closes
+	for (c = TEST_QUERY_CLIENTS; c < SERVER_MAX_CLIENTS + 1; c++) {
+		fds[c] = query_connect(path);
+	}
+	TEST_CHECK(query_request(fds[SERVER_MAX_CLIENTS], SERVER_OP_STATS, 0, resp) == -1);
+	TEST_CHECK(query_request(fds[SERVER_MAX_CLIENTS - 2], SERVER_OP_STATS, 0, resp) > 0);
+	printf("clients: %u requests: %" PRIu64 "\n", server_get_u32(&resp[SERVER_HEADER_BYTES + 24]), server_get_u64(&resp[SERVER_HEADER_BYTES + 16]));
+	for (c = 0; c < SERVER_MAX_CLIENTS + 1; c++) {
+		if (fds[c] >= 0) close(fds[c]);
+	}
+	close(greedy);
+	query_server_stop(&srv);
+	TEST_CHECK(query_connect(path) == -1);
+	tracker_destroy(&t);
+}
+
+// The rf_address index has to agree with a scan through eviction, expiry and slot reuse
+void test_rf_index(void) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	slot_link_t timer_links[TRACKER_CAPACITY];
+	uint32_t rf_index[RF_INDEX_BYTES(TRACKER_CAPACITY) / sizeof(uint32_t)];
+	pair_adv_data_t cur = {0};
+	unsigned long long ts = 0;
+	device_t *dev, *scan;
+	int lookups = 0, found = 0;
+	workload_t w;
+	tracker_t t;
+	int i;
+	
+	printf("======== test_rf_index ========\n");
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	tracker_set_max_age(&t, 300, 10, timer_links);
+	// Expiry and the other optional features need their links
+	TEST_CHECK(tracker_use_rssi_index(&t, NULL) == -1 && !t.rssi_indexed);
+	workload_init(&w, WORKLOAD_TRADESHOW, 46, 1581292800000ULL);
+	w.population = 60;
+	// Devices tracked before the index exists get indexed too
+	for (i = 0; i < 100; i++) {
+		ts = workload_next(&w, &cur);
+		on_discovery_at(&t, &cur, ts);
+	}
+	TEST_CHECK(tracker_find_by_rf_address(&t, device_rf_address(&t, t.head)) == NULL);
+	TEST_CHECK(tracker_use_rf_index(&t, rf_index) == 0);
+	for (i = 0; i < 20000; i++) {
+		ts = workload_next(&w, &cur);
+		on_discovery_at(&t, &cur, ts);
+		if (i % 100 == 0) tracker_expire(&t, ts);
+		
+		// Half of the lookups for the address just seen, half for one that may be gone
+		cur.rf_address = filter_hash(i % 2 ? cur.device_id : cur.device_id - 1);
+		for (scan = queue_first(&t); scan != NULL && device_rf_address(&t, scan) != cur.rf_address; scan = queue_next(&t, scan));
+		dev = tracker_find_by_rf_address(&t, cur.rf_address);
+		if (dev != scan) break;
+		lookups++;
+		found += dev != NULL;
+	}
+	printf("lookups: %d found: %d\n", lookups, found);
+	TEST_CHECK(lookups == 20000 && found > 0 && found < lookups);
+	tracker_destroy(&t);
+	for (i = 0; i < 2 * TRACKER_CAPACITY; i++) TEST_CHECK(rf_index[i] == 0);
+}
+
+#define TEST_FILTER_CAPACITY 100
+
+typedef struct name_check {
+	uint32_t ids[TRACKER_CAPACITY];
+	uint8_t last[16];
+	int count;
+	int unordered;
+} name_check_t;
+
+int name_check_visitor(const device_view_t *view, void *ctx) {
+	name_check_t *c = ctx;
+	if (c->count > 0 && memcmp(c->last, view->device_name, 16) > 0) c->unordered++;
+	memcpy(c->last, view->device_name, 16);
+	c->ids[c->count++] = view->device_id;
+	return 0;
+}
+
+int test_cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Prefix queries through the index against the plain scan, while devices come and go
+void test_name_index(void) {
+	const char *prefixes[] = { "", "PUMP-", "PUMP-1", "PUMP", "VALVE-", "VALVE-0000000007", "SENSOR", "P", "ZZZ" };
+	const char *kinds[] = { "PUMP-", "PUMPHOUSE-", "VALVE-", "SENSOR-" };
+	uint8_t mem_indexed[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_plain[TRACKER_BYTES(TRACKER_CAPACITY)];
+	name_key_t keys[TRACKER_CAPACITY];
+	name_check_t indexed, plain;
+	pair_adv_data_t cur = {0};
+	tracker_t a, b;
+	int i, p, mismatches = 0, matches = 0;
+	
+	printf("======== test_name_index ========\n");
+	tracker_init(&a, mem_indexed, TRACKER_CAPACITY, &policy_lru);
+	tracker_init(&b, mem_plain, TRACKER_CAPACITY, &policy_lru);
+	tracker_use_name_index(&a, keys);
+	srand(2020);
+	for (i = 0; i < 5000; i++) {
+		cur.device_id = 1 + rand() % 100;
+		memset(cur.device_name, 0, sizeof(cur.device_name));
+		// Every name uses all 16 bytes for some ids, to exercise the second word
+		snprintf((char *)cur.device_name, sizeof(cur.device_name), cur.device_id % 10 == 7 ? "%s%010u" : "%s%u",
+				kinds[cur.device_id % 4], cur.device_id);
+		if (cur.device_id % 10 == 7) memcpy(cur.device_name, "VALVE-0000000007", 16);
+		on_discovery_at(&a, &cur, i + 1);
+		on_discovery_at(&b, &cur, i + 1);
+		if (i % 50 != 49) continue;
+		
+		for (p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+			memset(&indexed, 0, sizeof(indexed));
+			memset(&plain, 0, sizeof(plain));
+			tracker_visit_by_name_prefix(&a, prefixes[p], strlen(prefixes[p]), i + 1, name_check_visitor, &indexed);
+			tracker_visit_by_name_prefix(&b, prefixes[p], strlen(prefixes[p]), i + 1, name_check_visitor, &plain);
+			qsort(indexed.ids, indexed.count, sizeof(uint32_t), test_cmp_u32);
+			qsort(plain.ids, plain.count, sizeof(uint32_t), test_cmp_u32);
+			if (indexed.unordered || indexed.count != plain.count ||
+					memcmp(indexed.ids, plain.ids, plain.count * sizeof(uint32_t)) != 0) mismatches++;
+			if (p == 1) matches += indexed.count;
+		}
+	}
+	printf("mismatches: %d, PUMP- matches per query: %.1f\n", mismatches, matches / 100.0);
+	TEST_CHECK(mismatches == 0 && matches > 0);
+	TEST_CHECK(a.name_count == a.device_count);
+	TEST_CHECK(tracker_visit_by_name_prefix(&a, "", 0, 0, name_check_visitor, &indexed) == a.device_count);
+	TEST_CHECK(tracker_visit_by_name_prefix(&a, "0123456789abcdefg", 17, 0, name_check_visitor, &indexed) == 0);
+	tracker_destroy(&a);
+	tracker_destroy(&b);
+	TEST_CHECK(a.name_count == 0);
+}
+
+typedef struct filter_check {
+	uint32_t ids[TEST_FILTER_CAPACITY];
+	device_view_t prev;
+	int order;
+	int count;
+	int unordered;
+} filter_check_t;
+
+int filter_check_visitor(const device_view_t *view, void *ctx) {
+	filter_check_t *c = ctx;
+	if (c->count > 0 && (c->order == REPORT_BY_RSSI ? view->rssi > c->prev.rssi : view->age_ms < c->prev.age_ms)) c->unordered++;
+	c->prev = *view;
+	c->ids[c->count++] = view->device_id;
+	return 0;
+}
+
+// Filtered reports off the columns against the same filters on a walk of the queue
+void test_filtered_report(void) {
+	uint8_t mem_columns[TRACKER_BYTES(TEST_FILTER_CAPACITY)];
+	uint8_t mem_plain[TRACKER_BYTES(TEST_FILTER_CAPACITY)];
+	uint64_t columns[REPORT_COLUMNS_BYTES(TEST_FILTER_CAPACITY) / 8 + 1];
+	filter_check_t with, without;
+	report_filter_t filter = {0};
+	pair_adv_data_t cur = {0};
+	tracker_t a, b;
+	int i, mismatches = 0, unordered = 0, selected = 0;
+	
+	printf("======== test_filtered_report ========\n");
+	tracker_init(&a, mem_columns, TEST_FILTER_CAPACITY, &policy_lfu);
+	tracker_init(&b, mem_plain, TEST_FILTER_CAPACITY, &policy_lfu);
+	srand(4242);
+	for (i = 0; i < 2000; i++) {
+		cur.device_id = 1 + rand() % 150;
+		cur.rssi = rand() % 256;
+		memset(cur.device_name, 0, sizeof(cur.device_name));
+		sprintf((char *)cur.device_name, cur.device_id % 3 ? "PUMP-%u" : "VALVE-%u", cur.device_id);
+		on_discovery_at(&a, &cur, 1000 + i * 10);
+		on_discovery_at(&b, &cur, 1000 + i * 10);
+		// Start the columns late, so the devices already tracked get copied in
+		if (i == 300) tracker_use_report_columns(&a, (uint8_t *)columns);
+		if (i < 300 || i % 20 != 0) continue;
+		
+		filter.min_rssi = rand() % 256;
+		filter.max_age_ms = rand() % 4 == 0 ? 0 : rand() % 3000;
+		filter.name_prefix = rand() % 2 ? NULL : "PUMP-1";
+		filter.name_len = 6;
+		memset(&with, 0, sizeof(with));
+		memset(&without, 0, sizeof(without));
+		with.order = without.order = i % 40 == 0 ? REPORT_BY_RSSI : REPORT_BY_TIME;
+		tracker_visit_filtered(&a, &filter, with.order, 1000 + i * 10, filter_check_visitor, &with);
+		tracker_visit_filtered(&b, &filter, without.order, 1000 + i * 10, filter_check_visitor, &without);
+		unordered += with.unordered + without.unordered;
+		qsort(with.ids, with.count, sizeof(uint32_t), test_cmp_u32);
+		qsort(without.ids, without.count, sizeof(uint32_t), test_cmp_u32);
+		if (with.count != without.count || memcmp(with.ids, without.ids, with.count * sizeof(uint32_t)) != 0) mismatches++;
+		selected += with.count;
+	}
+	printf("mismatches: %d, out of order: %d, selected: %d\n", mismatches, unordered, selected);
+	TEST_CHECK(mismatches == 0 && unordered == 0 && selected > 0);
+	
+	// Everything passes an empty filter
+	memset(&filter, 0, sizeof(filter));
+	memset(&with, 0, sizeof(with));
+	TEST_CHECK(tracker_visit_filtered(&a, &filter, REPORT_BY_RSSI, 0, filter_check_visitor, &with) == a.device_count);
+	tracker_destroy(&a);
+	tracker_destroy(&b);
+}
+
+#define TEST_PAYLOAD_MODELS 6
+
+// Devices of a few models, so most payloads repeat: interned trackers against one keeping copies
+void test_payload_store(void) {
+	uint8_t mem_full[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_a[TRACKER_INTERNED_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_b[TRACKER_INTERNED_BYTES(TRACKER_CAPACITY)];
+	uint64_t store_mem[PAYLOAD_STORE_BYTES(TEST_PAYLOAD_MODELS) / 8 + 1];
+	uint64_t small_mem[PAYLOAD_STORE_BYTES(2) / 8 + 1];
+	payload_store_t store, small;
+	pair_adv_data_t cur = {0};
+	tracker_t full, a, b;
+	unsigned long long ts;
+	uint32_t victim_id;
+	device_t *x, *y;
+	workload_t w;
+	int i, model, payloads_match = 1;
+	
+	printf("======== test_payload_store ========\n");
+	payload_store_init(&store, (uint8_t *)store_mem, TEST_PAYLOAD_MODELS);
+	tracker_init(&full, mem_full, TRACKER_CAPACITY, &policy_lru);
+	tracker_init_interned(&a, mem_a, TRACKER_CAPACITY, &policy_lru, &store);
+	tracker_init_interned(&b, mem_b, TRACKER_CAPACITY / 2, &policy_fifo, &store);
+	workload_init(&w, WORKLOAD_TRADESHOW, 49, 1581292800000ULL);
+	w.population = 200;
+	for (i = 0; i < 20000; i++) {
+		ts = workload_next(&w, &cur);
+		model = cur.device_id % TEST_PAYLOAD_MODELS;
+		memset(cur.device_name, 0, sizeof(cur.device_name));
+		memset(cur.device_data, 0, sizeof(cur.device_data));
+		sprintf((char *)cur.device_name, "PUMP-%d", model);
+		sprintf((char *)cur.device_data, "fw 2.%d.%d", model, model * 7);
+		on_discovery_at(&full, &cur, ts);
+		on_discovery_at(&a, &cur, ts);
+		on_discovery_at(&b, &cur, ts);
+	}
+	for (x = queue_first(&full), y = queue_first(&a); x != NULL && y != NULL; x = queue_next(&full, x), y = queue_next(&a, y)) {
+		if (memcmp(device_payload(&full, x), device_payload(&a, y), sizeof(device_payload_t)) != 0) payloads_match = 0;
+	}
+	printf("devices: %d + %d, payloads: %u, references: %u\n", a.device_count, b.device_count, store.count, store.refs);
+	printf("bytes: %zu with copies, %zu interned plus %zu for the store\n",
+			TRACKER_BYTES(TRACKER_CAPACITY), TRACKER_INTERNED_BYTES(TRACKER_CAPACITY), PAYLOAD_STORE_BYTES(TEST_PAYLOAD_MODELS));
+	// Counted in device blocks, which the malloc pool doesn't include in TRACKER_BYTES():
+	// interning has to at least halve the devices of both trackers, store included
+	TEST_CHECK(2 * (2 * TRACKER_CAPACITY * DEVICE_INTERNED_BLOCK_BYTES + PAYLOAD_STORE_BYTES(TEST_PAYLOAD_MODELS)) <
+			2 * TRACKER_CAPACITY * DEVICE_BLOCK_BYTES);
+	TEST_CHECK(tracker_same(&full, &a) && payloads_match);
+	TEST_CHECK(store.count == TEST_PAYLOAD_MODELS && store.refs == a.device_count + b.device_count);
+	
+	// A seventh model doesn't fit, and the victim shares its payload so evicting it wouldn't help
+	memset(cur.device_name, 0, sizeof(cur.device_name));
+	sprintf((char *)cur.device_name, "VALVE-1");
+	cur.device_id = 100000;
+	victim_id = a.tail->adv.device_id;
+	on_discovery_at(&a, &cur, ts + 1);
+	TEST_CHECK(tracker_find(&a, cur.device_id) == NULL && a.device_count == TRACKER_CAPACITY);
+	TEST_CHECK(tracker_find(&a, victim_id) != NULL && store.refs == a.device_count + b.device_count);
+	
+	// Entries go with their last reference, then there's room
+	tracker_destroy(&b);
+	TEST_CHECK(store.count == TEST_PAYLOAD_MODELS && store.refs == a.device_count);
+	tracker_destroy(&a);
+	TEST_CHECK(store.count == 0 && store.refs == 0);
+	tracker_init_interned(&a, mem_a, TRACKER_CAPACITY, &policy_lru, &store);
+	on_discovery_at(&a, &cur, ts + 2);
+	TEST_CHECK(tracker_find(&a, cur.device_id) != NULL && store.count == 1);
+	TEST_CHECK(strcmp((char *)device_name(&a, tracker_find(&a, cur.device_id)), "VALVE-1") == 0);
+	tracker_destroy(&a);
+	
+	// With the store full, a victim holding the last reference to its payload still makes room
+	payload_store_init(&small, (uint8_t *)small_mem, 2);
+	tracker_init_interned(&b, mem_b, 2, &policy_lru, &small);
+	for (i = 0; i < 3; i++) {
+		memset(cur.device_name, 0, sizeof(cur.device_name));
+		sprintf((char *)cur.device_name, "VALVE-%d", i + 2);
+		cur.device_id = 100001 + i;
+		on_discovery_at(&b, &cur, ts + 3 + i);
+	}
+	TEST_CHECK(tracker_find(&b, 100001) == NULL && tracker_find(&b, 100003) != NULL && b.device_count == 2);
+	TEST_CHECK(small.count == 2 && small.refs == 2);
+	tracker_destroy(&b);
+	TEST_CHECK(small.count == 0 && small.refs == 0);
+	tracker_destroy(&full);
+}
+
+// The dashboard profile against a full tracker: same devices, same report, no device_data
+void test_metadata_profile(void) {
+	uint8_t mem_full[TRACKER_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_meta[TRACKER_METADATA_BYTES(TRACKER_CAPACITY)];
+	uint8_t mem_restored[TRACKER_BYTES(TRACKER_CAPACITY)];
+	char report_full[RENDER_ROW_MAX * (TRACKER_CAPACITY + 1)];
+	char report_meta[RENDER_ROW_MAX * (TRACKER_CAPACITY + 1)];
+	uint8_t buf[SERIALIZE_MAX_BYTES(TRACKER_CAPACITY)];
+	uint8_t zeros[64] = {0};
+	pair_adv_data_t cur = {0};
+	tracker_t full, meta, restored;
+	unsigned long long ts = 0;
+	size_t len_full, len_meta;
+	device_t *x, *y;
+	workload_t w;
+	int i, names_match = 1, data_dropped = 1;
+	
+	printf("======== test_metadata_profile ========\n");
+	tracker_init(&full, mem_full, TRACKER_CAPACITY, &policy_clock);
+	tracker_init_metadata(&meta, mem_meta, TRACKER_CAPACITY, &policy_clock);
+	workload_init(&w, WORKLOAD_TRADESHOW, 50, 1581292800000ULL);
+	w.population = 100;
+	for (i = 0; i < 10000; i++) {
+		ts = workload_next(&w, &cur);
+		memset(cur.device_data, 0xa5, sizeof(cur.device_data));
+		on_discovery_at(&full, &cur, ts);
+		on_discovery_at(&meta, &cur, ts);
+	}
+	for (x = queue_first(&full), y = queue_first(&meta); x != NULL && y != NULL; x = queue_next(&full, x), y = queue_next(&meta, y)) {
+		if (memcmp(device_name(&full, x), device_name(&meta, y), 16) != 0) names_match = 0;
+	}
+	len_full = tracker_render_table(&full, REPORT_BY_RSSI, ts, report_full, sizeof(report_full));
+	len_meta = tracker_render_table(&meta, REPORT_BY_RSSI, ts, report_meta, sizeof(report_meta));
+	printf("block bytes: %zu full, %zu metadata; tracker bytes: %zu full, %zu metadata\n",
+			DEVICE_BLOCK_BYTES, DEVICE_METADATA_BLOCK_BYTES, TRACKER_BYTES(TRACKER_CAPACITY), TRACKER_METADATA_BYTES(TRACKER_CAPACITY));
+	TEST_CHECK(tracker_same(&full, &meta) && names_match);
+	TEST_CHECK(len_full > 0 && len_full == len_meta && memcmp(report_full, report_meta, len_full) == 0);
+	TEST_CHECK(device_data(&meta, queue_first(&meta)) == NULL && device_data(&full, queue_first(&full)) != NULL);
+	TEST_CHECK(device_rf_address(&meta, queue_first(&meta)) == 0 && tracker_use_rf_index(&meta, NULL) == -1);
+	// A dashboard device has to take at most half of what one took before the profiles
+	TEST_CHECK(2 * DEVICE_METADATA_BLOCK_BYTES <= sizeof(device_baseline_t));
+	
+	// device_data was never kept, so it doesn't come back from a serialized table
+	len_meta = tracker_serialize(&meta, SERIALIZE_PAYLOAD, buf, sizeof(buf));
+	tracker_init(&restored, mem_restored, TRACKER_CAPACITY, &policy_clock);
+	TEST_CHECK(tracker_deserialize(&restored, buf, len_meta) == meta.device_count);
+	for (x = queue_first(&restored); x != NULL; x = queue_next(&restored, x)) {
+		if (memcmp(device_data(&restored, x), zeros, sizeof(zeros)) != 0) data_dropped = 0;
+		if (memcmp(device_name(&restored, x), device_name(&meta, tracker_find(&meta, x->adv.device_id)), 16) != 0) names_match = 0;
+	}
+	TEST_CHECK(data_dropped && names_match);
+	tracker_destroy(&full);
+	tracker_destroy(&meta);
+	tracker_destroy(&restored);
+}
+
+#define TEST_MRC_EVENTS 30000
+#define TEST_MRC_GAP_MS 2000
+
+// The curve has to agree with real LRU trackers at every capacity we try
+void test_mrc(void) {
+	const int capacities[] = { 1, 5, 8, 32, 100, 400 };
+	pair_adv_data_t *trace = calloc(TEST_MRC_EVENTS, sizeof(pair_adv_data_t));
+	unsigned long long *times = malloc(TEST_MRC_EVENTS * sizeof(unsigned long long));
+	unsigned long long *last_seen = calloc(4096, sizeof(unsigned long long));
+	uint64_t misses, active;
+	uint8_t *mem;
+	workload_t w;
+	tracker_t t;
+	mrc_t m;
+	int c, i, capacity;
+	
+	printf("======== test_mrc ========\n");
+	workload_init(&w, WORKLOAD_TRADESHOW, 41, 1);
+	w.population = 200;
+	TEST_CHECK(mrc_init(&m, TEST_MRC_EVENTS, TEST_MRC_GAP_MS) == 0);
+	for (i = 0; i < TEST_MRC_EVENTS; i++) {
+		times[i] = workload_next(&w, &trace[i]);
+		TEST_CHECK(mrc_access(&m, trace[i].device_id, times[i]) == 0);
+	}
+	TEST_CHECK(mrc_access(&m, 1, times[i - 1]) == -1);
+	mrc_finish(&m);
+	
+	for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+		capacity = capacities[c];
+		mem = malloc(TRACKER_BYTES(capacity));
+		tracker_init(&t, mem, capacity, &policy_lru);
+		memset(last_seen, 0, 4096 * sizeof(unsigned long long));
+		misses = active = 0;
+		for (i = 0; i < TEST_MRC_EVENTS; i++) {
+			if (find_duplicate(&t, &trace[i]) == NULL) {
+				misses++;
+				if (last_seen[trace[i].device_id] != 0 && times[i] - last_seen[trace[i].device_id] <= TEST_MRC_GAP_MS) active++;
+			}
+			last_seen[trace[i].device_id] = times[i];
+			on_discovery_at(&t, &trace[i], times[i]);
+		}
+		tracker_destroy(&t);
+		free(mem);
+		printf("capacity: %d misses: %" PRIu64 " (curve %" PRIu64 ") active evictions: %" PRIu64 " (curve %" PRIu64 ")\n",
+				capacity, misses, mrc_misses(&m, capacity), active, mrc_active_evictions(&m, capacity));
+		TEST_CHECK(misses == mrc_misses(&m, capacity));
+		TEST_CHECK(active == mrc_active_evictions(&m, capacity));
+	}
+	TEST_CHECK(mrc_misses(&m, m.devices) == m.cold && mrc_active_evictions(&m, m.devices) == 0);
+	capacity = mrc_capacity_for(&m, 0.99);
+	printf("devices: %u, 99%% active retention at capacity %d\n", m.devices, capacity);
+	TEST_CHECK(mrc_active_evictions(&m, capacity) <= 0.01 * m.active_reuses);
+	TEST_CHECK(capacity == 1 || mrc_active_evictions(&m, capacity - 1) > 0.01 * m.active_reuses);
+	mrc_destroy(&m);
+	free(last_seen);
+	free(times);
+	free(trace);
+}
+
+#define TEST_RADIOS 3
+#define TEST_RADIO_DEVICES 40
+
+typedef struct merge_check {
+	// Best RSSI and latest sighting of each device over all radios, 0 when unseen
+	int best_rssi[TEST_RADIO_DEVICES + 1];
+	unsigned long long latest[TEST_RADIO_DEVICES + 1];
+	int reported[TEST_RADIO_DEVICES + 1];
+	unsigned long long now;
+	int last_rssi;
+	int errors;
+} merge_check_t;
+
+int merge_check_visitor(const device_view_t *view, void *ctx) {
+	merge_check_t *c = ctx;
+	if (view->rssi > c->last_rssi) c->errors++;
+	if (c->reported[view->device_id]++) c->errors++;
+	if (view->rssi != c->best_rssi[view->device_id]) c->errors++;
+	if (view->age_ms != c->now - c->latest[view->device_id]) c->errors++;
+	c->last_rssi = view->rssi;
+	return 0;
+}
+
+// Radios with overlapping devices, merged against a brute force over the same events
+void test_radio_merge(void) {
+	uint8_t mem[TEST_RADIOS][TRACKER_BYTES(TRACKER_CAPACITY)];
+	tracker_t radios[TEST_RADIOS];
+	tracker_t *trackers[TEST_RADIOS];
+	merge_check_t check = {{0}};
+	id_collector_t collected;
+	pair_adv_data_t cur = {0};
+	unsigned long long now = 1581292800000ULL;
+	device_t *dev;
+	int expected, visited, r, i;
+	
+	printf("======== test_radio_merge ========\n");
+	for (r = 0; r < TEST_RADIOS; r++) {
+		tracker_init(&radios[r], mem[r], TRACKER_CAPACITY, &policy_lru);
+		trackers[r] = &radios[r];
+	}
+	srand(2020);
+	for (i = 0; i < 2000; i++) {
+		now += rand() % 10;
+		cur.device_id = 1 + rand() % TEST_RADIO_DEVICES;
+		// Low RSSI range, so radios often tie
+		cur.rssi = rand() % 8;
+		on_discovery_at(&radios[rand() % TEST_RADIOS], &cur, now);
+	}
+	
+	// The devices still tracked somewhere, straight from each tracker
+	expected = 0;
+	for (i = 1; i <= TEST_RADIO_DEVICES; i++) {
+		cur.device_id = i;
+		check.best_rssi[i] = -1;
+		for (r = 0; r < TEST_RADIOS; r++) {
+			dev = find_duplicate(&radios[r], &cur);
+			if (dev == NULL) continue;
+			if (dev->adv.rssi > check.best_rssi[i]) check.best_rssi[i] = dev->adv.rssi;
+			if (dev->discovery_time > check.latest[i]) check.latest[i] = dev->discovery_time;
+		}
+		if (check.best_rssi[i] >= 0) expected++;
+	}
+	check.now = now;
+	check.last_rssi = 255;
+	visited = tracker_merge_visit_by_rssi(trackers, TEST_RADIOS, now, merge_check_visitor, &check);
+	printf("radios: %d devices: %d %d %d merged: %d\n", TEST_RADIOS,
+			radios[0].device_count, radios[1].device_count, radios[2].device_count, visited);
+	TEST_CHECK(visited == expected);
+	TEST_CHECK(check.errors == 0);
+	
+	// Merging a single tracker is just its RSSI report
+	collected.count = 0;
+	TEST_CHECK(tracker_merge_visit_by_rssi(trackers, 1, now, id_collector_visitor, &collected) == radios[0].device_count);
+	tracker_sort_by_rssi(&radios[0]);
+	for (i = 0; i < collected.count; i++) {
+		TEST_CHECK(collected.ids[i] == radios[0].sorted[i]->adv.device_id);
+	}
+	for (r = 0; r < TEST_RADIOS; r++) {
+		tracker_destroy(&radios[r]);
+	}
+	TEST_CHECK(tracker_merge_visit_by_rssi(trackers, TEST_RADIOS, now, merge_check_visitor, &check) == 0);
+	TEST_CHECK(tracker_merge_visit_by_rssi(trackers, 0, now, merge_check_visitor, &check) == 0);
+}
+
+#define TEST_SHARDS 4
+#define TEST_SHARD_EVENTS 4000
+
+// The K most recent across shards has to match one big LRU tracker of K devices
+void test_sharded(void) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	pair_adv_data_t trace[TEST_SHARD_EVENTS];
+	id_collector_t global = {0};
+	id_collector_t sharded;
+	sharded_tracker_t st;
+	unsigned long long now = TEST_SHARD_EVENTS + 1;
+	tracker_t t;
+	device_t *cur;
+	int threaded, i;
+	
+	printf("======== test_sharded ========\n");
+	srand(2020);
+	for (i = 0; i < TEST_SHARD_EVENTS; i++) {
+		memset(&trace[i], 0, sizeof(pair_adv_data_t));
+		trace[i].device_id = 1 + rand() % 200;
+		trace[i].rssi = rand();
+	}
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	for (i = 0; i < TEST_SHARD_EVENTS; i++) {
+		on_discovery_at(&t, &trace[i], i + 1);
+	}
+	for (cur = queue_first(&t); cur != NULL; cur = queue_next(&t, cur)) {
+		global.ids[global.count++] = cur->adv.device_id;
+	}
+	tracker_destroy(&t);
+	
+	for (threaded = 0; threaded <= 1; threaded++) {
+		TEST_CHECK(sharded_init(&st, TEST_SHARDS, TRACKER_CAPACITY, &policy_lru, 256) == 0);
+		if (threaded) {
+			struct timespec before, after;
+			TEST_CHECK(sharded_start(&st) == 0);
+			// With nothing to do the workers block instead of spinning
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &before);
+			usleep(100000);
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &after);
+			printf("idle cpu: %.1f ms in 100 ms\n", (after.tv_sec - before.tv_sec) * 1e3 + (after.tv_nsec - before.tv_nsec) / 1e6);
+			TEST_CHECK((after.tv_sec - before.tv_sec) * 1e3 + (after.tv_nsec - before.tv_nsec) / 1e6 < 20);
+			for (i = 0; i < TEST_SHARDS; i++) TEST_CHECK(atomic_load(&st.shards[i].sleeping));
+		}
+		for (i = 0; i < TEST_SHARD_EVENTS; i++) {
+			if (!threaded) {
+				sharded_on_discovery_at(&st, &trace[i], i + 1);
+			} else while (sharded_submit(&st, &trace[i], i + 1) != 0) {
+				sched_yield();
+			}
+		}
+		sharded_stop(&st);
+		
+		sharded.count = 0;
+		TEST_CHECK(sharded_visit_recent(&st, TRACKER_CAPACITY, now, id_collector_visitor, &sharded) == global.count);
+		TEST_CHECK(memcmp(sharded.ids, global.ids, global.count * sizeof(uint32_t)) == 0);
+		printf("%s: shard sizes", threaded ? "threaded" : "sync");
+		for (i = 0; i < TEST_SHARDS; i++) {
+			printf(" %d", st.shards[i].tracker.device_count);
+		}
+		printf(", most recent: %u\n", sharded.ids[0]);
+		sharded_destroy(&st);
+	}
+	
+	// A ring too big to allocate fails cleanly, and destroying after that is harmless
+	TEST_CHECK(sharded_init(&st, TEST_SHARDS, TRACKER_CAPACITY, &policy_lru, 1U << 31) == -1);
+	TEST_CHECK(st.shards == NULL && st.shard_count == 0);
+	TEST_CHECK(sharded_visit_recent(&st, TRACKER_CAPACITY, now, id_collector_visitor, &sharded) == 0);
+	sharded_destroy(&st);
+}
+
+/*
+ * ==========================
+ * Benchmarks
+ * ==========================
+ */
+
+unsigned long long bench_ns_get(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (unsigned long long)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+#define BENCH_LONG_LIVED WORKLOAD_LONG_LIVED
+#define BENCH_CROWD 96
+
+// The trade show workload with a crowd small enough that the long-lived
+// devices (ids 1..BENCH_LONG_LIVED) have a fighting chance to stay tracked
+void bench_make_trace(pair_adv_data_t *trace, int count) {
+	workload_t w;
+	int i;
+	workload_init(&w, WORKLOAD_TRADESHOW, 2020, 0);
+	w.population = BENCH_CROWD;
+	for (i = 0; i < count; i++) {
+		memset(&trace[i], 0, sizeof(pair_adv_data_t));
+		workload_next(&w, &trace[i]);
+	}
+}
+
+uint8_t bench_pool[ TRACKER_BYTES(TRACKER_CAPACITY) ];
+log_record_t bench_log[ 2 * TRACKER_CAPACITY ];
+
+void bench_tracker_init(tracker_t *t, const eviction_policy_t *policy) {
+	tracker_init(t, bench_pool, TRACKER_CAPACITY, policy);
+	if (policy == &policy_log) {
+		tracker_use_log(t, bench_log, 2 * TRACKER_CAPACITY);
+	}
+}
+
+void bench_eviction_policies(int events) {
+	const eviction_policy_t *policies[] = { &policy_lru, &policy_fifo, &policy_lfu, &policy_clock, &policy_log };
+	pair_adv_data_t *trace = malloc(events * sizeof(pair_adv_data_t));
+	unsigned long long start, elapsed;
+	tracker_t t;
+	int long_lived, retained;
+	int i, p;
+	
+	printf("======== bench_eviction_policies ========\n");
+	bench_make_trace(trace, events);
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		// Timed pass
+		bench_tracker_init(&t, policies[p]);
+		start = bench_ns_get();
+		for (i = 0; i < events; i++) {
+			on_discovery(&t, &trace[i]);
+		}
+		elapsed = bench_ns_get() - start;
+		tracker_destroy(&t);
+		
+		// Retention pass: how often a long-lived device was still tracked when it advertised again
+		long_lived = 0;
+		retained = 0;
+		bench_tracker_init(&t, policies[p]);
+		for (i = 0; i < events; i++) {
+			if (trace[i].device_id <= BENCH_LONG_LIVED) {
+				long_lived++;
+				if (find_duplicate(&t, &trace[i]) != NULL) retained++;
+			}
+			on_discovery(&t, &trace[i]);
+		}
+		tracker_destroy(&t);
+		
+		printf("policy: %s\tevents: %d\tevents/s: %.0f\tlong-lived retention: %.2f%%\n",
+				policies[p]->name,
+				events,
+				events / (elapsed / 1e9),
+				100.0 * retained / long_lived);
+	}
+	free(trace);
+}
+
+int bench_printf_visitor(const device_view_t *view, void *ctx) {
+	fprintf(ctx, "%u\t%.16s\t%u\t%llu\n", view->device_id, view->device_name, view->rssi, view->age_ms);
+	return 0;
+}
+
+// Rows per second through the printf path (line buffered, like our serial console) and the renderer
+void bench_render_table(int reports) {
+	uint8_t mem[TRACKER_BYTES(TRACKER_CAPACITY)];
+	pair_adv_data_t trace[TRACKER_CAPACITY];
+	unsigned long long start, elapsed;
+	unsigned long long now = systime_ms_get();
+	char buf[RENDER_ROW_MAX * (TRACKER_CAPACITY + 1)];
+	FILE *console = fopen("/dev/null", "w");
+	int fd = fileno(console);
+	int rows = reports * TRACKER_CAPACITY;
+	tracker_t t;
+	int i;
+	
+	printf("======== bench_render_table ========\n");
+	setvbuf(console, NULL, _IOLBF, BUFSIZ);
+	tracker_init(&t, mem, TRACKER_CAPACITY, &policy_lru);
+	bench_make_trace(trace, TRACKER_CAPACITY);
+	for (i = 0; i < TRACKER_CAPACITY; i++) {
+		trace[i].device_id = i + 1;
+		sprintf((char *)trace[i].device_name, "proprietary_%02d", i);
+		on_discovery_at(&t, &trace[i], now - i * 37);
+	}
+	
+	start = bench_ns_get();
+	for (i = 0; i < reports; i++) {
+		fprintf(console, RENDER_HEADER);
+		tracker_visit_by_rssi(&t, now, bench_printf_visitor, console);
+	}
+	elapsed = bench_ns_get() - start;
+	printf("path: printf\trows: %d\trows/s: %.0f\n", rows, rows / (elapsed / 1e9));
+	
+	start = bench_ns_get();
+	for (i = 0; i < reports; i++) {
+		tracker_render_table(&t, REPORT_BY_RSSI, now, buf, sizeof(buf));
+	}
+	elapsed = bench_ns_get() - start;
+	printf("path: render\trows: %d\trows/s: %.0f\n", rows, rows / (elapsed / 1e9));
+	
+	start = bench_ns_get();
+	for (i = 0; i < reports; i++) {
+		if (write(fd, buf, tracker_render_table(&t, REPORT_BY_RSSI, now, buf, sizeof(buf))) < 0) break;
+	}
+	elapsed = bench_ns_get() - start;
+	printf("path: render+write\trows: %d\trows/s: %.0f\n", rows, rows / (elapsed / 1e9));
+	
+	tracker_destroy(&t);
+	fclose(console);
+}
+
+int bench_count_visitor(const device_view_t *view, void *ctx) {
+	(*(int *)ctx)++;
+	return 0;
+}
+
+#define BENCH_FILTER_CAPACITY 4096
+
+// "RSSI above X seen in the last Y seconds" off the queue walk and off the report columns
+void bench_filtered_report(int reports) {
+	uint8_t *mem = malloc(TRACKER_BYTES(BENCH_FILTER_CAPACITY));
+	uint64_t *columns = malloc(REPORT_COLUMNS_BYTES(BENCH_FILTER_CAPACITY));
+	report_filter_t filter = { .min_rssi = 200, .max_age_ms = 5000 };
+	unsigned long long start, elapsed, now = 0;
+	pair_adv_data_t adv;
+	workload_t w;
+	tracker_t t;
+	int i, pass, visited;
+	
+	printf("======== bench_filtered_report ========\n");
+	tracker_init(&t, mem, BENCH_FILTER_CAPACITY, &policy_lru);
+	workload_init(&w, WORKLOAD_TRADESHOW, 2020, 0);
+	w.population = 2 * BENCH_FILTER_CAPACITY;
+	for (i = 0; i < 200000; i++) {
+		now = workload_next(&w, &adv);
+		on_discovery_at(&t, &adv, now);
+	}
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) tracker_use_report_columns(&t, (uint8_t *)columns);
+		visited = 0;
+		start = bench_ns_get();
+		for (i = 0; i < reports; i++) {
+			tracker_visit_filtered(&t, &filter, REPORT_BY_RSSI, now, bench_count_visitor, &visited);
+		}
+		elapsed = bench_ns_get() - start;
+		printf("path: %s\tdevices: %d\tselected: %d\treports/s: %.0f\n",
+				pass == 0 ? "queue" : "columns",
+				t.device_count,
+				visited / reports,
+				reports / (elapsed / 1e9));
+	}
+	tracker_destroy(&t);
+	free(columns);
+	free(mem);
+}
+
+typedef struct bench_shard_job {
+	sharded_tracker_t *st;
+	pair_adv_data_t *trace;
+	int count;
+} bench_shard_job_t;
+
+void * bench_shard_replay(void *arg) {
+	bench_shard_job_t *job = arg;
+	shard_t *shard = &job->st->shards[shard_of(job->st, job->trace[0].device_id)];
+	cpu_set_t cpus;
+	int i;
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->cpu % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	for (i = 0; i < job->count; i++) {
+		sharded_on_discovery_at(job->st, &job->trace[i], i + 1);
+	}
+	return NULL;
+}
+
+// Aggregate throughput with one thread per shard, each replaying the part of the trace its shard owns
+void bench_sharded_scaling(int events) {
+	pair_adv_data_t *trace = malloc(events * sizeof(pair_adv_data_t));
+	pair_adv_data_t *parts = malloc(events * sizeof(pair_adv_data_t));
+	bench_shard_job_t jobs[8];
+	pthread_t threads[8];
+	unsigned long long start, elapsed;
+	sharded_tracker_t st;
+	int threads_count, i, s, n;
+	
+	printf("======== bench_sharded_scaling ========\n");
+	printf("online cpus: %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	bench_make_trace(trace, events);
+	for (threads_count = 1; threads_count <= 8; threads_count *= 2) {
+		if (sharded_init(&st, threads_count, TRACKER_CAPACITY, &policy_lru, 2) != 0) break;
+		// Partition up front so the timed part is only the trackers
+		n = 0;
+		for (s = 0; s < threads_count; s++) {
+			jobs[s].st = &st;
+			jobs[s].trace = &parts[n];
+			for (i = 0; i < events; i++) {
+				if (shard_of(&st, trace[i].device_id) == s) parts[n++] = trace[i];
+			}
+			jobs[s].count = &parts[n] - jobs[s].trace;
+		}
+		start = bench_ns_get();
+		for (s = 0; s < threads_count; s++) {
+			if (jobs[s].count > 0) pthread_create(&threads[s], NULL, bench_shard_replay, &jobs[s]);
+		}
+		for (s = 0; s < threads_count; s++) {
+			if (jobs[s].count > 0) pthread_join(threads[s], NULL);
+		}
+		elapsed = bench_ns_get() - start;
+		printf("threads: %d\tevents: %d\tevents/s: %.0f\n", threads_count, events, events / (elapsed / 1e9));
+		sharded_destroy(&st);
+	}
+	free(parts);
+	free(trace);
+}
+
+// How fast each workload generates, and how fast an LRU tracker takes it on its virtual clock
+void bench_workloads(int events) {
+	const char *names[] = { "steady", "tradeshow", "zipf", "bursty" };
+	pair_adv_data_t *trace = calloc(events, sizeof(pair_adv_data_t));
+	unsigned long long *times = malloc(events * sizeof(unsigned long long));
+	unsigned long long start, generate, replay;
+	workload_t w;
+	tracker_t t;
+	int kind, i;
+	
+	printf("======== bench_workloads ========\n");
+	for (kind = WORKLOAD_STEADY; kind <= WORKLOAD_BURSTY; kind++) {
+		workload_init(&w, kind, 2020, 0);
+		start = bench_ns_get();
+		for (i = 0; i < events; i++) {
+			times[i] = workload_next(&w, &trace[i]);
+		}
+		generate = bench_ns_get() - start;
+		
+		bench_tracker_init(&t, &policy_lru);
+		start = bench_ns_get();
+		for (i = 0; i < events; i++) {
+			on_discovery_at(&t, &trace[i], times[i]);
+		}
+		replay = bench_ns_get() - start;
+		tracker_destroy(&t);
+		
+		printf("workload: %s\tevents: %d\tvirtual s: %.0f\tgenerated/s: %.0f\treplayed/s: %.0f\n",
+				names[kind],
+				events,
+				w.now / 1e3,
+				events / (generate / 1e9),
+				events / (replay / 1e9));
+	}
+	free(times);
+	free(trace);
+}
+
+int bench_cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Pool alloc/free round trips, ns per call
+double bench_suite_pool(int capacity) {
+	uint8_t *pool = malloc(POOL_BYTES(DEVICE_BLOCK_BYTES, capacity));
+	void **blocks = malloc(capacity * sizeof(void *));
+	int rounds = 1 + 4000000 / capacity;
+	unsigned long long start, elapsed;
+	int r, i;
+	pool_init(pool, DEVICE_BLOCK_BYTES, capacity);
+	start = bench_ns_get();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < capacity; i++) blocks[i] = pool_alloc(pool, DEVICE_BLOCK_BYTES);
+		for (i = capacity - 1; i >= 0; i--) pool_free(pool, blocks[i]);
+	}
+	elapsed = bench_ns_get() - start;
+	pool_destroy(pool);
+	free(blocks);
+	free(pool);
+	return (double)elapsed / (2.0 * rounds * capacity);
+}
+
+#define BENCH_FOOTPRINT_PAYLOADS 64
+
+// Tracker memory per profile against device_baseline_t; interned assumes BENCH_FOOTPRINT_PAYLOADS distinct payloads
+void bench_footprint(void) {
+	const int capacities[] = { 32, 1024, 65536 };
+	int i;
+	printf("======== bench_footprint ========\n");
+	printf("block bytes: baseline %zu\tfull %zu\tmetadata %zu\tinterned %zu\n",
+			sizeof(device_baseline_t), DEVICE_BLOCK_BYTES, DEVICE_METADATA_BLOCK_BYTES, DEVICE_INTERNED_BLOCK_BYTES);
+	for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+		size_t baseline = TRACKER_LAYOUT_BYTES(sizeof(device_baseline_t), capacities[i]);
+		size_t full = TRACKER_BYTES(capacities[i]);
+		size_t metadata = TRACKER_METADATA_BYTES(capacities[i]);
+		size_t interned = TRACKER_INTERNED_BYTES(capacities[i]) + PAYLOAD_STORE_BYTES(BENCH_FOOTPRINT_PAYLOADS);
+		printf("capacity: %d\tbaseline: %zu\tfull: %zu (%.0f%%)\tmetadata: %zu (%.0f%%)\tinterned: %zu (%.0f%%)\n",
+				capacities[i],
+				baseline,
+				full, 100.0 * full / baseline,
+				metadata, 100.0 * metadata / baseline,
+				interned, 100.0 * interned / baseline);
+	}
+}
+
+/*
+ * Every capacity against every workload, as CSV so runs can be diffed and
+ * plotted. Workload populations scale with capacity, so the big trackers
+ * actually fill up and evict. Latencies are one clock read per event, in a
+ * separate pass from the throughput number so they don't skew it.
+ */
+void bench_suite(int events) {
+	const int capacities[] = { 32, 256, 4096, 65536 };
+	const char *names[] = { "steady", "tradeshow", "zipf", "bursty" };
+	pair_adv_data_t *trace = calloc(events, sizeof(pair_adv_data_t));
+	unsigned long long *times = malloc(events * sizeof(unsigned long long));
+	uint32_t *latency = malloc(events * sizeof(uint32_t));
+	unsigned long long start, elapsed, ingest, find, now;
+	volatile uintptr_t sink = 0;
+	double pool_ns, report_rssi_us, report_time_us;
+	size_t buf_size;
+	uint8_t *mem;
+	char *buf;
+	workload_t w;
+	tracker_t t;
+	int c, kind, i, capacity, reports;
+	
+	printf("======== bench_suite ========\n");
+	printf("capacity,workload,events,ingest_events_per_s,ingest_p50_ns,ingest_p99_ns,ingest_p999_ns,ingest_max_ns,"
+			"find_duplicate_ns,pool_alloc_free_ns,report_rssi_us,report_time_us\n");
+	for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+		capacity = capacities[c];
+		mem = malloc(TRACKER_BYTES(capacity));
+		buf_size = RENDER_ROW_MAX * (capacity + 1);
+		buf = malloc(buf_size);
+		pool_ns = bench_suite_pool(capacity);
+		for (kind = WORKLOAD_STEADY; kind <= WORKLOAD_BURSTY; kind++) {
+			workload_init(&w, kind, 2020, 0);
+			if (kind == WORKLOAD_TRADESHOW && capacity > TRACKER_CAPACITY) {
+				w.population = 3 * capacity;
+			} else if (kind == WORKLOAD_ZIPF && capacity > TRACKER_CAPACITY) {
+				w.population = 3 * capacity;
+				workload_zipf_setup(&w);
+			}
+			for (i = 0; i < events; i++) {
+				times[i] = workload_next(&w, &trace[i]);
+			}
+			
+			tracker_init(&t, mem, capacity, &policy_lru);
+			start = bench_ns_get();
+			for (i = 0; i < events; i++) {
+				on_discovery_at(&t, &trace[i], times[i]);
+			}
+			ingest = bench_ns_get() - start;
+			
+			start = bench_ns_get();
+			for (i = 0; i < events; i++) {
+				sink += (uintptr_t)find_duplicate(&t, &trace[i]);
+			}
+			find = bench_ns_get() - start;
+			
+			now = times[events - 1];
+			reports = 1 + 200000 / capacity;
+			start = bench_ns_get();
+			for (i = 0; i < reports; i++) {
+				sink += tracker_render_table(&t, REPORT_BY_RSSI, now, buf, buf_size);
+			}
+			report_rssi_us = (bench_ns_get() - start) / 1e3 / reports;
+			start = bench_ns_get();
+			for (i = 0; i < reports; i++) {
+				sink += tracker_render_table(&t, REPORT_BY_TIME, now, buf, buf_size);
+			}
+			report_time_us = (bench_ns_get() - start) / 1e3 / reports;
+			tracker_destroy(&t);
+			
+			tracker_init(&t, mem, capacity, &policy_lru);
+			for (i = 0; i < events; i++) {
+				start = bench_ns_get();
+				on_discovery_at(&t, &trace[i], times[i]);
+				elapsed = bench_ns_get() - start;
+				latency[i] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+			}
+			tracker_destroy(&t);
+			qsort(latency, events, sizeof(uint32_t), bench_cmp_u32);
+			
+			printf("%d,%s,%d,%.0f,%u,%u,%u,%u,%.1f,%.1f,%.1f,%.1f\n",
+					capacity,
+					names[kind],
+					events,
+					events / (ingest / 1e9),
+					latency[events / 2],
+					latency[events / 100 * 99],
+					latency[events / 1000 * 999],
+					latency[events - 1],
+					(double)find / events,
+					pool_ns,
+					report_rssi_us,
+					report_time_us);
+		}
+		free(buf);
+		free(mem);
+	}
+	free(latency);
+	free(times);
+	free(trace);
+}
+
+int main(int argc, char**argv) {
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench_eviction_policies(1000000);
+		bench_render_table(20000);
+		bench_filtered_report(20000);
+		bench_sharded_scaling(1000000);
+		bench_workloads(1000000);
+		bench_footprint();
+		bench_suite(500000);
+		return 0;
+	}
+	// Just the CSV
+	if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+		bench_suite(argc > 2 ? atoi(argv[2]) : 500000);
+		return 0;
+	}
+	if (argc > 2 && strcmp(argv[1], "record") == 0) {
+		return trace_main_record(argv[2], argc > 3 ? atoi(argv[3]) : WORKLOAD_TRADESHOW, argc > 4 ? atoi(argv[4]) : 1000000);
+	}
+	if (argc > 3 && strcmp(argv[1], "serve") == 0) {
+		return trace_main_serve(argv[2], argv[3]);
+	}
+	if (argc > 3 && strcmp(argv[1], "query") == 0) {
+		return query_main(argc, argv);
+	}
+	if (argc > 2 && strcmp(argv[1], "mrc") == 0) {
+		return mrc_main(argv[2], argc > 3 ? strtoull(argv[3], NULL, 10) : 5000, argc > 4 ? atof(argv[4]) : 0.99);
+	}
+	if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+		return trace_main_replay(argv[2], argc > 3 && strcmp(argv[3], "recorded") == 0 ? TRACE_SPEED_RECORDED : TRACE_SPEED_MAX);
+	}
+	
+	printf("Proprietary BLE pairing test\n");
+	test_pool();
+	tracker_init(&tracker, device_pool, TRACKER_CAPACITY, &policy_lru);
+	test_time();
 	test_queue_fill();
 	//pool_print(device_pool);
 	test_duplicates();
 	//pool_print(device_pool);
 	test_duplicates_and_uniques();
 	//pool_print(device_pool);
-	return 0;
+	test_eviction_policies();
+	test_observation_log();
+	test_expiry();
+	test_rate_limit();
+	test_prefilter();
+	test_visitors();
+	test_render_table();
+	test_top_k();
+	test_delta_reports();
+	test_snapshot();
+	test_radio_merge();
+	test_sharded();
+	test_workloads();
+	test_trace();
+	test_mrc();
+	test_persist();
+	test_serialize();
+	test_shm_export();
+	test_query_server();
+	test_rf_index();
+	test_name_index();
+	test_filtered_report();
+	test_payload_store();
+	test_metadata_profile();
+	return test_failures ? 1 : 0;
 }
 